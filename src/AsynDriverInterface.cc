@@ -30,6 +30,8 @@
 #include <epicsAssert.h>
 #include <epicsTime.h>
 #include <epicsTimer.h>
+#include <epicsMutex.h>
+#include "StreamTimer.h"
 extern "C" {
 #include <callback.h>
 }
@@ -72,7 +74,9 @@ writeRequest()
         writeCallback(StreamIoTimeout)
 
 readRequest()
-    pasynManager->queueRequest()
+    if called from writeCallback(StreamIoSuccess) in writeHandler()
+        handle request directly after writeCallback() returns
+    else pasynManager->queueRequest()
     when request is handled
         optionally: pasynOctet->setInputEos()
         pasynOctet->read()
@@ -101,6 +105,17 @@ initially. This calls intrCallbackOctet() every time input is received,
 but only if someone else is doing a read. Thus, if nobody reads
 something, arrange for periodical read polls.
 
+All "I/O Intr" interfaces of the same port and address share one
+InputDemux which is the only interrupt user. It keeps the literal
+prefixes of the listening in commands in a trie and calls
+asynReadHandler() only for those interfaces whose prefix can match
+a new message. Continuation chunks go to the same interfaces as the
+start of the message. Chunks in which a new message starts before
+their end go to everyone. Without a common terminator for all
+listeners message boundaries are unknown and every chunk goes to
+everyone.
+(EPICS 3.13 still registers every interface separately.)
+
 */
 
 extern "C" {
@@ -133,6 +148,14 @@ static const char* eomReasonStr[] = {
     "NONE", "CNT", "EOS", "CNT+EOS", "END", "CNT+END", "EOS+END", "CNT+EOS+END"
 };
 
+struct PortInput;
+#ifndef EPICS_3_13
+class InputDemux;
+// Set to 1 to skip discarding old input before writing when
+// nothing can be pending (see PortInput).
+extern int streamSkipIdleDrain; // defined in StreamEpics.cc
+#endif
+
 class AsynDriverInterface : StreamBusInterface
 #ifndef EPICS_3_13
  , epicsTimerNotify
@@ -164,12 +187,21 @@ class AsynDriverInterface : StreamBusInterface
     const char* outputBuffer;
     size_t outputSize;
     int peeksize;
+    bool inWriteCallback;    // readRequest() can be served right away
+    bool fusedRead;          // readRequest() came during writeCallback()
+    PortInput* port;
 #ifdef EPICS_3_13
     WDOG_ID timer;
     CALLBACK timeoutCallback;
 #else
     epicsTimerQueueActive* timerQueue;
     epicsTimer* timer;
+    InputDemux* demux;
+    AsynDriverInterface* nextListener;
+    StreamBuffer inPrefix;
+    StreamBuffer inTerminator;
+    bool waiting;            // in AsyncRead, needs polls (demux lock)
+    friend class InputDemux;
 #endif
 
     AsynDriverInterface(Client* client);
@@ -206,6 +238,10 @@ class AsynDriverInterface : StreamBusInterface
     void disconnectHandler();
     bool connectToAsynPort();
     void asynReadHandler(const char *data, size_t numchars, int eomReason);
+    size_t keepAhead(char* buffer, size_t received, const char* eos,
+        size_t eoslen, StreamBuffer& seen);
+    bool getInputEos(const char*& eos, int& eoslen);
+    bool setInputEos(const char* eos, int eoslen);
     asynQueuePriority priority() {
         return static_cast<asynQueuePriority>
             (StreamBusInterface::priority());
@@ -247,6 +283,122 @@ public:
 
 RegisterStreamBusInterface(AsynDriverInterface);
 
+#ifndef EPICS_3_13
+// One per asyn port and address with "I/O Intr" listeners
+class InputDemux
+{
+    struct Node
+    {
+        Node* child;
+        Node* sibling;
+        char byte;
+        StreamBuffer listeners;    // whose prefix ends here
+        Node(char byte) : child(NULL), sibling(NULL), byte(byte) {}
+        ~Node();
+        void collect(StreamBuffer& receivers) const;
+    };
+
+    static InputDemux* first;
+    static epicsMutex firstLock;
+    InputDemux* next;
+    StreamBuffer portname;
+    int addr;
+    asynUser* pasynUser;
+    asynOctet* pasynOctet;
+    void* pvtOctet;
+    void* intrPvtOctet;
+    epicsMutex lock;            // listeners, trie and state
+    epicsMutex dispatchLock;    // held while calling listeners
+    AsynDriverInterface* listeners;
+    AsynDriverInterface* poller;    // the one waiting listener that polls
+    Node* root;
+    StreamBuffer terminator;    // common to all listeners or empty
+    StreamBuffer current;       // receivers of the current message
+    StreamBuffer tail;          // end of the last chunk, for terminators
+    bool dirty;
+    bool atStart;
+    bool dispatching;           // listeners are being called
+
+    InputDemux(const char* portname, int addr);
+    ~InputDemux();
+    bool connect();
+    void rebuild();
+    void select(const char* data, size_t numchars);
+    bool hasTerminator(const char* data, size_t numchars) const;
+    bool splitTerminator(const char* data, size_t numchars) const;
+    void promote();
+    static bool pollsFaster(const AsynDriverInterface* a,
+        const AsynDriverInterface* b);
+public:
+    static InputDemux* attach(AsynDriverInterface* interface,
+        const char* portname, int addr);
+    void detach(AsynDriverInterface* interface);
+    void listen(AsynDriverInterface* interface);
+    bool wait(AsynDriverInterface* interface);
+    void unwait(AsynDriverInterface* interface);
+    bool polls(AsynDriverInterface* interface);
+    void dispatch(const char* data, size_t numchars, int eomReason);
+};
+
+InputDemux* InputDemux::first;
+epicsMutex InputDemux::firstLock;
+#endif
+
+// What we know about unread input of an asyn port and address.
+// Only changed in handlers, which asyn serializes per port.
+struct PortInput
+{
+    PortInput* next;
+    StreamBuffer portname;
+    int addr;
+    bool idle;      // last I/O was a read which ended at end of message
+    bool listened;  // "I/O Intr" records need all input forwarded
+    char eos[16];   // input EOS got or set in the current read
+    int eoslen;     // -1: unknown, -2: not supported
+    StreamBuffer ahead; // read beyond the terminator (no EOS support)
+
+    static PortInput* first;
+#ifndef EPICS_3_13
+    static epicsMutex firstLock;
+#endif
+    static PortInput* find(const char* portname, int addr);
+};
+
+PortInput* PortInput::first;
+#ifndef EPICS_3_13
+epicsMutex PortInput::firstLock;
+#endif
+
+PortInput* PortInput::
+find(const char* portname, int addr)
+{
+    PortInput* port;
+
+#ifndef EPICS_3_13
+    firstLock.lock();
+#endif
+    for (port = first; port; port = port->next)
+    {
+        if (port->addr == addr &&
+            strcmp(port->portname(), portname) == 0) break;
+    }
+    if (!port)
+    {
+        port = new PortInput;
+        port->portname = portname;
+        port->addr = addr;
+        port->idle = false;
+        port->listened = false;
+        port->eoslen = -1;
+        port->next = first;
+        first = port;
+    }
+#ifndef EPICS_3_13
+    firstLock.unlock();
+#endif
+    return port;
+}
+
 AsynDriverInterface::
 AsynDriverInterface(Client* client) : StreamBusInterface(client)
 {
@@ -262,6 +414,8 @@ AsynDriverInterface(Client* client) : StreamBusInterface(client)
     eventMask = 0;
     receivedEvent = 0;
     peeksize = 1;
+    inWriteCallback = false;
+    fusedRead = false;
     debug ("AsynDriverInterface(%s) createAsynUser\n", client->name());
     pasynUser = pasynManager->createAsynUser(handleRequest,
         handleTimeout);
@@ -277,9 +431,13 @@ AsynDriverInterface(Client* client) : StreamBusInterface(client)
     timerQueue = &epicsTimerQueueActive::allocate(true);
     assert(timerQueue);
     debug ("AsynDriverInterface(%s) timerQueue->createTimer()\n", client->name());
-    timer = &timerQueue->createTimer();
+    timer = &streamCreateTimer(*timerQueue);
     assert(timer);
+    demux = NULL;
+    nextListener = NULL;
+    waiting = false;
 #endif
+    port = NULL;
     debug ("AsynDriverInterface(%s) done\n", client->name());
 }
 
@@ -304,6 +462,9 @@ AsynDriverInterface::
     {
         // octet stream interface is connected
         int wasQueued;
+#ifndef EPICS_3_13
+        if (demux) demux->detach(this);
+#endif
         if (intrPvtOctet)
         {
             pasynOctet->cancelInterruptUser(pvtOctet,
@@ -415,14 +576,26 @@ supportsEvent()
 bool AsynDriverInterface::
 supportsAsyncRead()
 {
+    const char *portname;
+    int addr;
+
+#ifdef EPICS_3_13
     if (intrPvtOctet) return true;
 
     // hook "I/O Intr" support
     if (pasynOctet->registerInterruptUser(pvtOctet, pasynUser,
         intrCallbackOctet, this, &intrPvtOctet) != asynSuccess)
+#else
+    if (demux) return true;
+
+    // hook "I/O Intr" support via the shared demultiplexer
+    pasynManager->getPortName(pasynUser, &portname);
+    pasynManager->getAddr(pasynUser, &addr);
+    demux = InputDemux::attach(this, portname, addr);
+    if (demux) port->listened = true;
+    if (!demux)
+#endif
     {
-        const char *portname;
-        int addr;
         pasynManager->getPortName(pasynUser, &portname);
         pasynManager->getAddr(pasynUser, &addr);
         if (addr >= 0)
@@ -449,6 +622,7 @@ connectToBus(const char* portname, int addr)
         // asynDriver does not know this portname/address
         return false;
     }
+    port = PortInput::find(portname, addr);
 
     asynInterface* pasynInterface;
 
@@ -666,6 +840,17 @@ writeHandler()
     size_t written = 0;
 
     pasynUser->timeout = 0;
+    // discard input read ahead for the previous reply
+    port->ahead.clear();
+#ifndef EPICS_3_13
+    if (streamSkipIdleDrain && port->idle && !port->listened)
+    {
+        // The last reply ended at end of message: nothing to discard
+        debug("AsynDriverInterface::writeHandler(%s): port is idle\n",
+            clientName());
+    }
+    else
+#endif
     if (!pasynGpib)
     // discard any early input, but forward it to potential async records
     // thus do not use pasynOctet->flush()
@@ -695,6 +880,8 @@ writeHandler()
         
     // discard any early events
     receivedEvent = 0;
+    // the device may answer
+    port->idle = false;
     
     pasynUser->timeout = writeTimeout;
     
@@ -766,7 +953,14 @@ writeHandler()
                 // or handleTimeout() -> writeCallback(StreamIoTimeout)
                 return;
             }
+            inWriteCallback = true;
             writeCallback(StreamIoSuccess);
+            inWriteCallback = false;
+            if (fusedRead)
+            {
+                fusedRead = false;
+                readHandler();
+            }
             return;
         case asynTimeout:
             error("%s: asynTimeout (%g sec) in write. Asyn says: %s\n",
@@ -821,7 +1015,23 @@ readRequest(unsigned long replyTimeout_ms, unsigned long readTimeout_ms,
     
     if (async)
     {
+#ifndef EPICS_3_13
         ioAction = AsyncRead;
+        // tell the demultiplexer which input we are waiting for
+        if (demux)
+        {
+            demux->listen(this);
+            if (!demux->wait(this))
+            {
+                // another listener polls the port for us
+                // continues with:
+                //    intrCallbackOctet() -> asynReadHandler()
+                return true;
+            }
+        }
+#else
+        ioAction = AsyncRead;
+#endif
         queueTimeout = -1.0;
         // First poll for input (no timeout),
         // later poll periodically if no other input arrives
@@ -830,6 +1040,15 @@ readRequest(unsigned long replyTimeout_ms, unsigned long readTimeout_ms,
     else {
         ioAction = Read;
         queueTimeout = replyTimeout;
+        if (inWriteCallback)
+        {
+            // The in command directly follows the out command and we
+            // are still in the port thread: read without queueing.
+            fusedRead = true;
+            // continues with:
+            //    writeHandler() -> readHandler() -> readCallback()
+            return true;
+        }
     }
     status = pasynManager->queueRequest(pasynUser,
         priority(), queueTimeout);
@@ -866,6 +1085,7 @@ readHandler()
     const char* deveos;
     int oldeoslen = -1;
     char oldeos[16];
+    const char* eos;
     
     // Setup eos if required.
     streameos = getInTerminator(streameoslen);
@@ -873,10 +1093,12 @@ readHandler()
     deveoslen = streameoslen;
     if (streameos) // streameos == NULL means: don't change eos
     {
-        asynStatus status;
-        status = pasynOctet->getInputEos(pvtOctet,
-            pasynUser, oldeos, sizeof(oldeos)-1, &oldeoslen);
-        if (status != asynSuccess)
+        if (getInputEos(eos, oldeoslen))
+        {
+            // eos changes with the next set
+            memcpy(oldeos, eos, oldeoslen);
+        }
+        if (oldeoslen < 0)
         {
             // No EOS support?
             if (streameos[0])
@@ -887,8 +1109,7 @@ readHandler()
             oldeoslen = -1;
         } else do {
             // device (e.g. GPIB) might not accept full eos length
-            if (pasynOctet->setInputEos(pvtOctet, pasynUser,
-                deveos, deveoslen) == asynSuccess)
+            if (setInputEos(deveos, deveoslen))
             {
 #ifndef NO_TEMPORARY
                 if (ioAction != AsyncRead)
@@ -945,6 +1166,16 @@ readHandler()
     asynStatus status;
     long readMore;
     int connected;
+    bool syncRead = ioAction == Read;
+    port->idle = false;
+
+    // Without EOS support the driver returns whatever has arrived.
+    // Then read as much as possible and keep what follows the
+    // terminator for the next read on this port.
+    bool readAhead = syncRead && streameoslen && port->eoslen == -2 &&
+        expectedLength <= 0;
+    StreamBuffer seen; // end of the last chunk, may hold part of eos
+    if (readAhead) bytesToRead = buffersize;
 
     while (1)
     {
@@ -952,13 +1183,25 @@ readHandler()
         received = 0;
         eomReason = 0;
         
-        debug("AsynDriverInterface::readHandler(%s): ioAction=%s "
-            "read(..., bytesToRead=%ld, ...) "
-            "[timeout=%g sec]\n",
-            clientName(), ioActionStr[ioAction],
-            bytesToRead, pasynUser->timeout);
-        status = pasynOctet->read(pvtOctet, pasynUser,
-            buffer, bytesToRead, &received, &eomReason);
+        if (readAhead && port->ahead)
+        {
+            // left over from the previous read on this port
+            received = port->ahead.length();
+            if ((long)received > bytesToRead) received = bytesToRead;
+            memcpy(buffer, port->ahead(), received);
+            port->ahead.remove(received);
+            status = asynSuccess;
+        }
+        else
+        {
+            debug("AsynDriverInterface::readHandler(%s): ioAction=%s "
+                "read(..., bytesToRead=%ld, ...) "
+                "[timeout=%g sec]\n",
+                clientName(), ioActionStr[ioAction],
+                bytesToRead, pasynUser->timeout);
+            status = pasynOctet->read(pvtOctet, pasynUser,
+                buffer, bytesToRead, &received, &eomReason);
+        }
         debug("AsynDriverInterface::readHandler(%s): "
             "read returned %s: ioAction=%s received=%ld, eomReason=%s, buffer=\"%s\"\n",
             clientName(), asynStatusStr[status], ioActionStr[ioAction],
@@ -971,7 +1214,11 @@ readHandler()
             clientName(),connected?"":"dis");        
         // asyn 4.16 sets reason to ASYN_EOM_END when device disconnects.
         // What about earlier versions?
-        if (!connected) eomReason |= ASYN_EOM_END;
+        if (!connected)
+        {
+            eomReason |= ASYN_EOM_END;
+            port->eoslen = -1;
+        }
         
         if (status == asynTimeout &&
             pasynUser->timeout == 0.0 &&
@@ -983,6 +1230,12 @@ readHandler()
             status = asynSuccess;
         }
 
+        if (readAhead && received)
+        {
+            received = keepAhead(buffer, received, streameos,
+                streameoslen, seen);
+        }
+
         switch (status)
         {
             case asynSuccess:
@@ -1136,20 +1389,484 @@ readHandler()
         pasynUser->timeout = readTimeout;
         waitForReply = false;
     }
+    // A reply that ended with its terminator or end flag leaves
+    // nothing behind unless the device sends more than asked for.
+    port->idle = syncRead && status == asynSuccess && connected &&
+        eomReason & (ASYN_EOM_EOS|ASYN_EOM_END) && !port->ahead;
     
     // restore original EOS
     if (oldeoslen >= 0)
     {
-        pasynOctet->setInputEos(pvtOctet, pasynUser,
-            oldeos, oldeoslen);
+        setInputEos(oldeos, oldeoslen);
+    }
+}
+
+// Returns how much of buffer belongs to the current message and
+// stores what follows the terminator in front of port->ahead.
+// seen holds the end of the previous chunk of this message because
+// the terminator may be split between chunks.
+size_t AsynDriverInterface::
+keepAhead(char* buffer, size_t received, const char* eos, size_t eoslen,
+    StreamBuffer& seen)
+{
+    StreamBuffer border(seen);
+    size_t i, end = 0;
+
+    // terminator starting in the previous chunk
+    border.append(buffer, received < eoslen ? received : eoslen - 1);
+    for (i = 0; i + eoslen <= (size_t)border.length(); i++)
+    {
+        if (memcmp(border(i), eos, eoslen) == 0)
+        {
+            end = i + eoslen - seen.length();
+            break;
+        }
+    }
+    // terminator within this chunk
+    for (i = 0; !end && i + eoslen <= received; i++)
+    {
+        if (memcmp(buffer + i, eos, eoslen) == 0) end = i + eoslen;
+    }
+    if (end && end < received)
+    {
+        debug("AsynDriverInterface::keepAhead(%s): %ld bytes ahead\n",
+            clientName(), (long)(received - end));
+        port->ahead.insert(0, buffer + end, received - end);
+        received = end;
+    }
+    size_t tail = received < eoslen ? received : eoslen - 1;
+    seen.append(buffer + received - tail, tail);
+    if (seen.length() >= (ssize_t)eoslen)
+        seen.remove(seen.length() - eoslen + 1);
+    return received;
+}
+
+// Input EOS of the port, asked from the driver each time because other
+// asyn users may change it. Only missing EOS support is remembered
+// until the next (re)connect.
+bool AsynDriverInterface::
+getInputEos(const char*& eos, int& eoslen)
+{
+    if (port->eoslen != -2 &&
+        pasynOctet->getInputEos(pvtOctet, pasynUser, port->eos,
+            sizeof(port->eos)-1, &port->eoslen) != asynSuccess)
+    {
+        port->eoslen = -2;
+    }
+    eos = port->eos;
+    eoslen = port->eoslen;
+    return eoslen >= 0;
+}
+
+// Sets the input EOS unless getInputEos() or setInputEos() found it
+// already set. Only valid while the port stays locked, i.e. within
+// one readHandler() call.
+bool AsynDriverInterface::
+setInputEos(const char* eos, int eoslen)
+{
+    if (port->eoslen == eoslen && memcmp(port->eos, eos, eoslen) == 0)
+        return true;
+    if (pasynOctet->setInputEos(pvtOctet, pasynUser, eos, eoslen)
+        != asynSuccess)
+        return false;
+    if (eoslen < (int)sizeof(port->eos))
+    {
+        memcpy(port->eos, eos, eoslen);
+        port->eoslen = eoslen;
+    }
+    else port->eoslen = -1;
+    return true;
+}
+
+#ifndef EPICS_3_13
+InputDemux::Node::
+~Node()
+{
+    delete child;
+    delete sibling;
+}
+
+// Adds the listeners of this node and all nodes below
+void InputDemux::Node::
+collect(StreamBuffer& receivers) const
+{
+    receivers.append(listeners);
+    for (const Node* n = child; n; n = n->sibling)
+        n->collect(receivers);
+}
+
+static bool sameBytes(const StreamBuffer& buffer, const char* s, size_t size)
+{
+    return buffer.length() == (ssize_t)size &&
+        (size == 0 || memcmp(buffer(), s, size) == 0);
+}
+
+InputDemux::
+InputDemux(const char* _portname, int addr) :
+    portname(_portname), addr(addr)
+{
+    next = NULL;
+    pasynOctet = NULL;
+    intrPvtOctet = NULL;
+    listeners = NULL;
+    poller = NULL;
+    root = NULL;
+    dirty = true;
+    atStart = true;
+    dispatching = false;
+    pasynUser = pasynManager->createAsynUser(NULL, NULL);
+    assert(pasynUser);
+    pasynUser->userPvt = this;
+}
+
+InputDemux::
+~InputDemux()
+{
+    delete root;
+    pasynManager->disconnect(pasynUser);
+    pasynManager->freeAsynUser(pasynUser);
+}
+
+bool InputDemux::
+connect()
+{
+    asynInterface* pasynInterface;
+
+    if (pasynManager->connectDevice(pasynUser, portname(), addr)
+        != asynSuccess)
+        return false;
+    pasynInterface = pasynManager->findInterface(pasynUser,
+        asynOctetType, true);
+    if (!pasynInterface) return false;
+    pasynOctet = static_cast<asynOctet*>(pasynInterface->pinterface);
+    pvtOctet = pasynInterface->drvPvt;
+    return pasynOctet->registerInterruptUser(pvtOctet, pasynUser,
+        intrCallbackOctet, this, &intrPvtOctet) == asynSuccess;
+}
+
+InputDemux* InputDemux::
+attach(AsynDriverInterface* interface, const char* portname, int addr)
+{
+    InputDemux* demux;
+
+    firstLock.lock();
+    for (demux = first; demux; demux = demux->next)
+    {
+        if (demux->addr == addr &&
+            strcmp(demux->portname(), portname) == 0) break;
+    }
+    if (!demux)
+    {
+        demux = new InputDemux(portname, addr);
+        if (!demux->connect())
+        {
+            strncpy(interface->pasynUser->errorMessage,
+                demux->pasynUser->errorMessage,
+                interface->pasynUser->errorMessageSize-1);
+            firstLock.unlock();
+            delete demux;
+            return NULL;
+        }
+        debug("InputDemux::attach: new demultiplexer for %s addr %d\n",
+            portname, addr);
+        demux->next = first;
+        first = demux;
+    }
+    firstLock.unlock();
+
+    demux->lock.lock();
+    interface->nextListener = demux->listeners;
+    demux->listeners = interface;
+    demux->dirty = true;
+    demux->lock.unlock();
+    return demux;
+}
+
+void InputDemux::
+detach(AsynDriverInterface* interface)
+{
+    AsynDriverInterface** pl;
+    long i;
+
+    // wait until no listener is called any more
+    dispatchLock.lock();
+    unwait(interface);
+    lock.lock();
+    for (pl = &listeners; *pl; pl = &(*pl)->nextListener)
+    {
+        if (*pl == interface)
+        {
+            *pl = interface->nextListener;
+            break;
+        }
+    }
+    for (i = 0; i < current.length(); i += sizeof(interface))
+    {
+        if (memcmp(current(i), &interface, sizeof(interface)) == 0)
+        {
+            current.remove(i, sizeof(interface));
+            break;
+        }
+    }
+    dirty = true;
+    lock.unlock();
+    dispatchLock.unlock();
+}
+
+// Called whenever interface starts waiting for asynchronous input
+void InputDemux::
+listen(AsynDriverInterface* interface)
+{
+    const char* prefix;
+    const char* term;
+    size_t prefixlen, termlen;
+
+    prefix = interface->getInPrefix(prefixlen);
+    term = interface->getInTerminator(termlen);
+    lock.lock();
+    if (!sameBytes(interface->inPrefix, prefix, prefixlen) ||
+        !sameBytes(interface->inTerminator, term, termlen))
+    {
+        interface->inPrefix.set(prefix, prefixlen);
+        interface->inTerminator.set(term, termlen);
+        dirty = true;
+    }
+    lock.unlock();
+}
+
+// A poll period of 0 means no periodic polls at all
+bool InputDemux::
+pollsFaster(const AsynDriverInterface* a, const AsynDriverInterface* b)
+{
+    return a->replyTimeout != 0.0 &&
+        (b->replyTimeout == 0.0 || a->replyTimeout < b->replyTimeout);
+}
+
+// Called when interface starts waiting for asynchronous input.
+// Only one waiting listener polls the port, the one with the
+// shortest poll period. Input from its polls reaches all listeners
+// through dispatch(). Returns true if interface is that poller.
+bool InputDemux::
+wait(AsynDriverInterface* interface)
+{
+    bool result;
+
+    lock.lock();
+    interface->waiting = true;
+    if (!poller || pollsFaster(interface, poller)) poller = interface;
+    result = poller == interface;
+    lock.unlock();
+    return result;
+}
+
+// Called when interface stops waiting for asynchronous input.
+// If it was the poller, another waiting listener takes over, but only
+// once after dispatch() has called all listeners of a message.
+void InputDemux::
+unwait(AsynDriverInterface* interface)
+{
+    lock.lock();
+    interface->waiting = false;
+    if (poller == interface)
+    {
+        poller = NULL;
+        if (!dispatching) promote();
+    }
+    lock.unlock();
+}
+
+// Makes the waiting listener with the shortest poll period the poller
+// if there is none (called with lock held). It polls when its poll
+// period has passed, like after a poll of its own.
+void InputDemux::
+promote()
+{
+    AsynDriverInterface* l;
+
+    if (poller) return;
+    for (l = listeners; l; l = l->nextListener)
+    {
+        if (l->waiting && (!poller || pollsFaster(l, poller)))
+            poller = l;
+    }
+    if (poller)
+    {
+        debug("InputDemux::promote(%s addr %d): %s takes over polling "
+            "in %g sec\n",
+            portname(), addr, poller->clientName(), poller->replyTimeout);
+        // Start under lock: detach() cannot delete the poller now.
+        if (poller->replyTimeout != 0.0)
+            poller->startTimer(poller->replyTimeout);
+    }
+}
+
+// Does interface still poll for all listeners?
+bool InputDemux::
+polls(AsynDriverInterface* interface)
+{
+    bool result;
+
+    lock.lock();
+    result = poller == interface;
+    lock.unlock();
+    return result;
+}
+
+// Rebuilds the prefix trie (called with lock held)
+void InputDemux::
+rebuild()
+{
+    AsynDriverInterface* l;
+    Node* node;
+    Node** pn;
+    long i;
+
+    delete root;
+    root = new Node(0);
+    terminator.clear();
+    tail.clear();
+    if (listeners) terminator = listeners->inTerminator;
+    for (l = listeners; l; l = l->nextListener)
+    {
+        if (!sameBytes(l->inTerminator, terminator(), terminator.length()))
+            terminator.clear();
+        node = root;
+        for (i = 0; i < l->inPrefix.length(); i++)
+        {
+            for (pn = &node->child; *pn; pn = &(*pn)->sibling)
+                if ((*pn)->byte == l->inPrefix[i]) break;
+            if (!*pn) *pn = new Node(l->inPrefix[i]);
+            node = *pn;
+        }
+        node->listeners.append(&l, sizeof(l));
+    }
+    dirty = false;
+    debug("InputDemux::rebuild(%s addr %d): terminator \"%s\"\n",
+        portname(), addr, terminator.expand()());
+}
+
+// Does a new message start within data?
+bool InputDemux::
+hasTerminator(const char* data, size_t numchars) const
+{
+    size_t i;
+    size_t termlen = terminator.length();
+
+    for (i = 0; i + termlen < numchars; i++)
+    {
+        if (memcmp(data + i, terminator(), termlen) == 0) return true;
+    }
+    return false;
+}
+
+// Does a new message start after a terminator which began at the end
+// of the last chunk and ends within data?
+bool InputDemux::
+splitTerminator(const char* data, size_t numchars) const
+{
+    size_t k;
+    size_t termlen = terminator.length();
+
+    for (k = 1; k < termlen && k <= (size_t)tail.length(); k++)
+    {
+        if (termlen - k < numchars &&
+            memcmp(tail() + tail.length() - k, terminator(), k) == 0 &&
+            memcmp(data, terminator() + k, termlen - k) == 0) return true;
+    }
+    return false;
+}
+
+// Selects the listeners whose prefix can match a message starting
+// with data (called with lock held)
+void InputDemux::
+select(const char* data, size_t numchars)
+{
+    const Node* node = root;
+    const Node* n;
+    size_t i;
+
+    current.clear();
+    for (i = 0; i < numchars; i++)
+    {
+        current.append(node->listeners);
+        for (n = node->child; n; n = n->sibling)
+            if (n->byte == data[i]) break;
+        if (!n) return;
+        node = n;
+    }
+    // the message may continue with any longer prefix
+    node->collect(current);
+}
+
+void InputDemux::
+dispatch(const char* data, size_t numchars, int eomReason)
+{
+    AsynDriverInterface* interface;
+    StreamBuffer receivers;
+    long i;
+    size_t termlen;
+
+    dispatchLock.lock();
+    lock.lock();
+    if (dirty) rebuild();
+    termlen = terminator.length();
+    if (!termlen)
+    {
+        // message boundaries unknown
+        current.clear();
+        for (interface = listeners; interface;
+            interface = interface->nextListener)
+            current.append(&interface, sizeof(interface));
+    }
+    else if (hasTerminator(data, numchars) ||
+        (!atStart && splitTerminator(data, numchars)))
+    {
+        // a new message starts before the end: let everyone parse it
+        current.clear();
+        for (interface = listeners; interface;
+            interface = interface->nextListener)
+            current.append(&interface, sizeof(interface));
+    }
+    else if (atStart) select(data, numchars);
+    atStart = (eomReason & (ASYN_EOM_EOS|ASYN_EOM_END)) ||
+        (numchars >= termlen && termlen &&
+        memcmp(data + numchars - termlen, terminator(), termlen) == 0);
+    if (termlen > 1)
+    {
+        tail.append(data, numchars);
+        if (tail.length() >= (ssize_t)termlen)
+            tail.remove(tail.length() - termlen + 1);
+    }
+    receivers = current;
+    dispatching = true;
+    lock.unlock();
+    debug("InputDemux::dispatch(%s addr %d): %ld receivers\n",
+        portname(), addr, receivers.length() / (long)sizeof(interface));
+
+    // Call listeners without lock: they may call listen()
+    for (i = 0; i < receivers.length(); i += sizeof(interface))
+    {
+        memcpy(&interface, receivers(i), sizeof(interface));
+        interface->asynReadHandler(data, numchars, eomReason);
     }
+    // if the poller got the message, one other listener takes over
+    lock.lock();
+    dispatching = false;
+    promote();
+    lock.unlock();
+    dispatchLock.unlock();
 }
+#endif
 
-void intrCallbackOctet(void* /*pvt*/, asynUser *pasynUser,
+void intrCallbackOctet(void* pvt, asynUser *pasynUser,
     char *data, size_t numchars, int eomReason)
 {
+#ifdef EPICS_3_13
     AsynDriverInterface* interface =
         static_cast<AsynDriverInterface*>(pasynUser->userPvt);
+#else
+    InputDemux* demux = static_cast<InputDemux*>(pvt);
+#endif
 
 // Problems here:
 // 1. We get this message too when we are the poller.
@@ -1158,7 +1875,11 @@ void intrCallbackOctet(void* /*pvt*/, asynUser *pasynUser,
 //    internal buffer of asynDriver.
 
     if (!interruptAccept) return; // too early to process records
+#ifdef EPICS_3_13
     interface->asynReadHandler(data, numchars, eomReason);
+#else
+    demux->dispatch(data, numchars, eomReason);
+#endif
 }
 
 // get asynchronous input
@@ -1177,6 +1898,10 @@ asynReadHandler(const char *buffer, size_t received, int eomReason)
     // Thus, it is sufficient to mark the request as obsolete by
     // setting ioAction=None. See handleRequest().
     
+#ifndef EPICS_3_13
+    // If we were polling for all listeners, pass that on.
+    if (demux) demux->unwait(this);
+#endif
 #ifndef NO_TEMPORARY
     debug("AsynDriverInterface::asynReadHandler(%s, buffer=\"%s\", "
             "received=%ld eomReason=%s) ioAction=%s\n",
@@ -1192,11 +1917,10 @@ asynReadHandler(const char *buffer, size_t received, int eomReason)
         // terminators for interrupt users and never sets eomReason.
         // This may change in future releases of asynDriver.
         
-        asynStatus status;
         const char* streameos;
         size_t streameoslen;
         streameos = getInTerminator(streameoslen);
-        char deveos[16]; // I guess that is sufficient
+        const char* deveos;
         int deveoslen;
         
         if (eomReason & ASYN_EOM_EOS)
@@ -1215,9 +1939,7 @@ asynReadHandler(const char *buffer, size_t received, int eomReason)
             else
             {
                 // Try to add terminator
-                status = pasynOctet->getInputEos(pvtOctet,
-                    pasynUser, deveos, sizeof(deveos)-1, &deveoslen);
-                if (status == asynSuccess)
+                if (getInputEos(deveos, deveoslen))
                 {
                     // We can't just append terminator to buffer, because
                     // we don't own that piece of memory.
@@ -1235,9 +1957,8 @@ asynReadHandler(const char *buffer, size_t received, int eomReason)
         {
             // If terminator was not cut off and terminator was not
             // set by stream, cut it off now.
-            status = pasynOctet->getInputEos(pvtOctet,
-                pasynUser, deveos, sizeof(deveos)-1, &deveoslen);
-            if (status == asynSuccess && (long)received >= (long)deveoslen)
+            if (getInputEos(deveos, deveoslen) &&
+                (long)received >= (long)deveoslen)
             {
                 int i;
                 for (i = 1; i <= deveoslen; i++)
@@ -1343,6 +2064,13 @@ timerExpired()
             // readCallback() may have started a new poll
             return;
         case AsyncRead:
+#ifndef EPICS_3_13
+            if (demux && !demux->polls(this))
+            {
+                // another listener has taken over polling
+                return;
+            }
+#endif
             // No async input for some time, thus let's poll.
             // Due to multithreading, asynReadHandler() might be active
             // at the moment if another asynUser got input right now.
@@ -1423,6 +2151,9 @@ connectRequest(unsigned long connecttimeout_ms)
 void AsynDriverInterface::
 connectHandler()
 {
+    port->idle = false;
+    port->eoslen = -1;
+    port->ahead.clear();
     connectCallback(connectToAsynPort() ? StreamIoSuccess : StreamIoFault);
 }
 
@@ -1453,6 +2184,9 @@ disconnectHandler()
     int connected;
     asynStatus status;
 
+    port->idle = false;
+    port->eoslen = -1;
+    port->ahead.clear();
     pasynManager->isConnected(pasynUser, &connected);
     debug("AsynDriverInterface::disconnectHandler %s is %s disconnected\n",
         clientName(), !connected ? "already" : "not yet");
@@ -1477,6 +2211,9 @@ finish()
         clientName());
     cancelTimer();
     ioAction = None;
+#ifndef EPICS_3_13
+    if (demux) demux->unwait(this);
+#endif
 //     if (pasynGpib)
 //     {
 //         // Release GPIB device the the end of the protocol
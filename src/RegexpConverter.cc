@@ -41,6 +41,7 @@ class RegexpConverter : public StreamFormatConverter
     int scanString(const StreamFormat& fmt, const char*, char*, size_t);
     int scanPseudo(const StreamFormat& fmt, StreamBuffer& input, long& cursor);
     bool printPseudo(const StreamFormat& fmt, StreamBuffer& output);
+    bool cacheable(const StreamFormat&) { return false; } // info has pcre*
 };
 
 int RegexpConverter::
@@ -30,6 +30,14 @@
 #define vsnprintf epicsVsnprintf
 #endif
 
+#ifndef va_copy
+#ifdef __va_copy
+#define va_copy __va_copy
+#else
+#define va_copy(dst, src) memcpy(&(dst), &(src), sizeof(va_list))
+#endif
+#endif
+
 #define P PRINTF_SIZE_T_PREFIX
 
 void StreamBuffer::
@@ -251,12 +259,22 @@ replace(ssize_t remstart, ssize_t remlen, const void* ins, ssize_t inslen)
 
 StreamBuffer& StreamBuffer::
 print(const char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vprint(fmt, va);
+    va_end(va);
+    return *this;
+}
+
+StreamBuffer& StreamBuffer::
+vprint(const char* fmt, va_list args)
 {
     va_list va;
     ssize_t printed;
     while (1)
     {
-        va_start(va, fmt);
+        va_copy(va, args);
         printed = vsnprintf(buffer+offs+len, cap-offs-len, fmt, va);
         va_end(va);
         if (printed > -1 && printed < (ssize_t)(cap-offs-len))
@@ -22,6 +22,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #include <sys/types.h>
 
@@ -198,6 +199,8 @@ public:
     StreamBuffer& print(const char* fmt, ...)
         __attribute__ ((format(printf,2,3)));
 
+    StreamBuffer& vprint(const char* fmt, va_list args);
+
     // find: get index of data in buffer or -1
     ssize_t find(char c, ssize_t start=0) const
         {char* p;
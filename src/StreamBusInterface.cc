@@ -152,3 +152,10 @@ priority()
 {
     return 0;
 }
+
+const char* StreamBusInterface::Client::
+getInPrefix(size_t& length)
+{
+    length = 0;
+    return NULL;
+}
@@ -59,6 +59,7 @@ public:
         virtual long priority();
         virtual const char* getInTerminator(size_t& length) = 0;
         virtual const char* getOutTerminator(size_t& length) = 0;
+        virtual const char* getInPrefix(size_t& length);
     public:
         virtual const char* name() = 0;
         virtual ~Client();
@@ -136,6 +137,8 @@ protected:
         { return client->getInTerminator(length); }
     const char* getOutTerminator(size_t& length)
         { return client->getOutTerminator(length); }
+    const char* getInPrefix(size_t& length)
+        { return client->getInPrefix(length); }
     long priority() { return client->priority(); }
     const char* clientName() { return client->name(); }
 
@@ -22,13 +22,15 @@
 #include "StreamError.h"
 #include <ctype.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
 
 #define P PRINTF_SIZE_T_PREFIX
 
 enum Commands { end_cmd, in_cmd, out_cmd, wait_cmd, event_cmd, exec_cmd,
-    connect_cmd, disconnect_cmd };
+    connect_cmd, disconnect_cmd, const_out_cmd };
 const char* commandStr[] = { "end", "in", "out", "wait", "event", "exec",
-    "connect", "disconnect" };
+    "connect", "disconnect", "out" };
 
 inline const char* commandName(unsigned char i)
 {
@@ -57,6 +59,24 @@ static char* printCommands(StreamBuffer& buffer, const char* c)
                 c = StreamProtocolParser::printString(buffer, c);
                 buffer.append("\";\n");
                 break;
+            case const_out_cmd:
+            {
+                // precomputed output: raw bytes including terminator
+                size_t length = extract<size_t>(c);
+                StreamBuffer literal;
+                for (size_t i = 0; i < length; i++)
+                {
+                    if (c[i] < StreamProtocolParser::last_function_code ||
+                        c[i] == esc) literal.append(esc);
+                    literal.append(c[i]);
+                }
+                c += length;
+                buffer.append("    out \"");
+                StreamProtocolParser::printString(buffer, literal());
+                buffer.print("\"; # constant, %" P "u bytes with terminator\n",
+                    length);
+                break;
+            }
             case wait_cmd:
                 timeout = extract<unsigned long>(c);
                 buffer.print("    wait %ld; # ms\n", timeout);
@@ -90,43 +110,53 @@ void StreamCore::
 printProtocol()
 {
     StreamBuffer buffer;
-    printf("%s {\n", protocolname());
+    if (!compiled)
+    {
+        printf("%s: no protocol loaded\n", name());
+        return;
+    }
+    printf("%s {\n", compiled->name());
     printf("  extraInput    = %s;\n",
       (flags & IgnoreExtraInput) ? "ignore" : "error");
-    printf("  lockTimeout   = %ld; # ms\n", lockTimeout);
-    printf("  readTimeout   = %ld; # ms\n", readTimeout);
-    printf("  replyTimeout  = %ld; # ms\n", replyTimeout);
-    printf("  writeTimeout  = %ld; # ms\n", writeTimeout);
-    printf("  pollPeriod    = %ld; # ms\n", pollPeriod);
-    printf("  maxInput      = %ld; # bytes\n", maxInput);
-    StreamProtocolParser::printString(buffer.clear(), inTerminator());
+    printf("  lockTimeout   = %ld; # ms\n", compiled->lockTimeout);
+    printf("  readTimeout   = %ld; # ms\n", compiled->readTimeout);
+    printf("  replyTimeout  = %ld; # ms\n", compiled->replyTimeout);
+    printf("  writeTimeout  = %ld; # ms\n", compiled->writeTimeout);
+    printf("  pollPeriod    = %ld; # ms\n", compiled->pollPeriod);
+    printf("  maxInput      = %ld; # bytes\n", compiled->maxInput);
+    printf("  outputChunk   = %ld; # bytes\n", compiled->outputChunk);
+    printf("  replyCache    = %ld; # ms\n", compiled->replyCache);
+    StreamProtocolParser::printString(buffer.clear(), compiled->inTerminator());
     printf("  inTerminator  = \"%s\";\n", buffer());
-        StreamProtocolParser::printString(buffer.clear(), outTerminator());
+        StreamProtocolParser::printString(buffer.clear(), compiled->outTerminator());
     printf("  outTerminator = \"%s\";\n", buffer());
-        StreamProtocolParser::printString(buffer.clear(), separator());
+        StreamProtocolParser::printString(buffer.clear(), compiled->separator());
     printf("  separator     = \"%s\";\n", buffer());
-    if (onInit)
+    printf("  # code: %ld bytes, %ld after optimization, %" P "u decoded\n",
+        compiled->codeSize, compiled->optimizedSize, compiled->decodedSize);
+    if (compiled->onInit)
         printf("  @Init {\n%s  }\n",
-        printCommands(buffer.clear(), onInit()));
-    if (onReplyTimeout)
+        printCommands(buffer.clear(), compiled->onInit()));
+    if (compiled->onReplyTimeout)
         printf("  @ReplyTimeout {\n%s  }\n",
-        printCommands(buffer.clear(), onReplyTimeout()));
-    if (onReadTimeout)
+        printCommands(buffer.clear(), compiled->onReplyTimeout()));
+    if (compiled->onReadTimeout)
         printf("  @ReadTimeout {\n%s  }\n",
-        printCommands(buffer.clear(), onReadTimeout()));
-    if (onWriteTimeout)
+        printCommands(buffer.clear(), compiled->onReadTimeout()));
+    if (compiled->onWriteTimeout)
         printf("  @WriteTimeout {\n%s  }\n",
-        printCommands(buffer.clear(), onWriteTimeout()));
-    if (onMismatch)
+        printCommands(buffer.clear(), compiled->onWriteTimeout()));
+    if (compiled->onMismatch)
         printf("  @Mismatch {\n%s  }\n",
-        printCommands(buffer.clear(), onMismatch()));
+        printCommands(buffer.clear(), compiled->onMismatch()));
     printf("\n%s}\n",
-        printCommands(buffer.clear(), commands()));
+        printCommands(buffer.clear(), compiled->commands()));
 }
 
 ///////////////////////////////////////////////////////////////////////////
 
 StreamCore* StreamCore::first = NULL;
+StreamCore::Compiled* StreamCore::sharedProtocols = NULL;
 
 StreamCore::
 StreamCore()
@@ -134,6 +164,13 @@ StreamCore()
     businterface = NULL;
     flags = None;
     next = NULL;
+    compiled = NULL;
+    io = NULL;
+    building = NULL;
+    pending = NULL;
+    commandIndex = NULL;
+    activeCommand = NULL;
+    activeElement = NULL;
     unparsedInput = false;
     // add myself to list of streams
     StreamCore** pstream;
@@ -156,6 +193,9 @@ StreamCore::
             break;
         }
     }
+    releaseCompiled();
+    release(pending);
+    delete io;
 }
 
 bool StreamCore::
@@ -171,6 +211,7 @@ attachBus(const char* busname, int addr, const char* param)
     }
     debug("StreamCore::attachBus(busname=\"%s\", addr=%i, param=\"%s\") businterface=%p\n",
         busname, addr, param, (void*)businterface);
+    busKey.clear().print("%s %d %s", busname, addr, param ? param : "");
     return true;
 }
 
@@ -188,12 +229,90 @@ releaseBus()
     }
 }
 
+// The @init handler talks to the device the same way for every record
+// if it only writes constant output, reads and waits, and if no error
+// handler can run. Then it can be run before the record is initialized.
+
+bool StreamCore::
+canRunInitAhead()
+{
+    int i;
+    if (!compiled || !compiled->onInit) return false;
+    for (i = WriteTimeoutCode; i < CodeCount; i++)
+    {
+        if (compiled->entry[i]->command != end_cmd) return false;
+    }
+    for (const Instruction* in = compiled->entry[InitCode];
+        in->command != end_cmd; in++)
+    {
+        if (in->command != const_out_cmd && in->command != in_cmd &&
+            in->command != wait_cmd) return false;
+    }
+    return true;
+}
+
 // Parse the protocol
 
+// Parse and compile the protocol.
+// With lazy, only check that the protocol exists and leave compiled
+// NULL unless the protocol has an @init handler or is already compiled.
+// Compilation is then done on the first start (see compileOnDemand()).
+
 bool StreamCore::
-parse(const char* filename, const char* _protocolname)
+parse(const char* filename, const char* protocolAndParams, bool lazy)
 {
-    protocolname = _protocolname;
+    if (!load(filename, protocolAndParams, lazy)) return false;
+    releaseCompiled();
+    install(building);
+    building = NULL;
+    return true;
+}
+
+// Compile the protocol again (for streamReload) while the current one
+// may be running. On error, the current protocol stays.
+// If the protocol is unchanged, the current code is kept. Otherwise the
+// new code replaces it immediately if no protocol is running, else on
+// the next startProtocol(). The replaced code is released then.
+// Shared code is never modified, the new code is shared under the new
+// key, thus other records find it when they reload.
+// The caller must hold the record mutex and the compile lock.
+
+bool StreamCore::
+reload(const char* filename, const char* protocolAndParams, bool lazy)
+{
+    if (!load(filename, protocolAndParams, lazy)) return false;
+    release(pending);
+    if (building == compiled)
+    {
+        debug("StreamCore::reload(%s): %s unchanged\n",
+            name(), protocolAndParams);
+        release(building);
+        return true;
+    }
+    if (flags & Running)
+    {
+        debug("StreamCore::reload(%s): %s changed, install on next start\n",
+            name(), protocolAndParams);
+        pending = building;
+        building = NULL;
+        return true;
+    }
+    debug("StreamCore::reload(%s): %s changed\n",
+        name(), protocolAndParams);
+    releaseCompiled();
+    install(building);
+    building = NULL;
+    return true;
+}
+
+// Find or compile the protocol and leave a reference to it in building
+// (NULL if compilation is deferred). The current protocol is not touched.
+
+bool StreamCore::
+load(const char* filename, const char* _protocolname, bool lazy)
+{
+    StreamBuffer protocolname(_protocolname);
+    building = NULL;
     // extract substitutions from protocolname "name(sub1,sub2)"
     int i = protocolname.find('(');
     if (i >= 0)
@@ -211,38 +330,403 @@ parse(const char* filename, const char* _protocolname)
         }
         protocolname.truncate(-1); // remove ')'
     }
-    StreamProtocolParser::Protocol* protocol;
-    protocol = StreamProtocolParser::getProtocol(filename, protocolname);
-    if (!protocol)
+    StreamBuffer key;
+    bool keyed = protocolKey(filename, _protocolname, key);
+    if (keyed)
     {
-        error("while reading protocol '%s' for '%s'\n", protocolname(), name());
-        return false;
+        // re-use protocol compiled for an other record
+        for (building = sharedProtocols; building; building = building->next)
+        {
+            if (building->key.length() == key.length() &&
+                building->key.startswith(key(), key.length()) &&
+                (!building->events || busSupportsEvent())) break;
+        }
+        if (building)
+        {
+            building->refcount++;
+            debug("StreamCore::load(%s): sharing protocol %s\n",
+                name(), _protocolname);
+            return true;
+        }
     }
-    if (!compile(protocol))
+    building = new Compiled;
+    building->key = key;
+    building->name = protocolname;
+    if (!(keyed && cachePath && readCache()))
     {
+        StreamProtocolParser::Protocol* protocol;
+        protocol = StreamProtocolParser::getProtocol(filename, protocolname);
+        if (!protocol)
+        {
+            error("while reading protocol '%s' for '%s'\n",
+                protocolname(), name());
+            release(building);
+            return false;
+        }
+        if (lazy && !protocol->hasHandler("@init"))
+        {
+            debug("StreamCore::load(%s): compiling %s deferred\n",
+                name(), _protocolname);
+            delete protocol;
+            release(building);
+            return true;
+        }
+        if (!compile(protocol))
+        {
+            delete protocol;
+            error("while compiling protocol '%s' for '%s'\n",
+                _protocolname, name());
+            release(building);
+            return false;
+        }
         delete protocol;
-        error("while compiling protocol '%s' for '%s'\n", _protocolname, name());
+        if (keyed && cachePath)
+        {
+            writeCache();
+        }
+    }
+    if (keyed && building->shareable)
+    {
+        building->next = sharedProtocols;
+        sharedProtocols = building;
+    }
+    return true;
+}
+
+// Make compiled code the current protocol.
+// No protocol must be running.
+
+void StreamCore::
+install(Compiled* code)
+{
+    compiled = code;
+    commandIndex = NULL;
+    activeCommand = NULL;
+    activeElement = NULL;
+    flags &= ~IgnoreExtraInput;
+    if (compiled && compiled->ignoreExtraInput) flags |= IgnoreExtraInput;
+}
+
+void StreamCore::
+releaseCompiled()
+{
+    release(compiled);
+}
+
+// Drop a reference to compiled code and delete the code with the last one.
+
+void StreamCore::
+release(Compiled*& code)
+{
+    if (!code) return;
+    if (--code->refcount == 0)
+    {
+        Compiled** pcompiled;
+        for (pcompiled = &sharedProtocols; *pcompiled;
+            pcompiled = &(*pcompiled)->next)
+        {
+            if (*pcompiled == code)
+            {
+                *pcompiled = code->next;
+                break;
+            }
+        }
+        delete code;
+    }
+    code = NULL;
+}
+
+// Two compilations of a protocol are interchangeable if they
+// result in the same variables and code.
+
+bool StreamCore::
+sameCode(const Compiled* a, const Compiled* b)
+{
+    const StreamBuffer* bufa[] = { &a->inTerminator, &a->outTerminator,
+        &a->separator, &a->commands, &a->onInit, &a->onWriteTimeout,
+        &a->onReplyTimeout, &a->onReadTimeout, &a->onMismatch };
+    const StreamBuffer* bufb[] = { &b->inTerminator, &b->outTerminator,
+        &b->separator, &b->commands, &b->onInit, &b->onWriteTimeout,
+        &b->onReplyTimeout, &b->onReadTimeout, &b->onMismatch };
+    unsigned int i;
+
+    if (a->shareable != b->shareable ||
+        a->events != b->events ||
+        a->ignoreExtraInput != b->ignoreExtraInput ||
+        a->lockTimeout != b->lockTimeout ||
+        a->writeTimeout != b->writeTimeout ||
+        a->replyTimeout != b->replyTimeout ||
+        a->readTimeout != b->readTimeout ||
+        a->pollPeriod != b->pollPeriod ||
+        a->maxInput != b->maxInput ||
+        a->outputChunk != b->outputChunk ||
+        a->replyCache != b->replyCache ||
+        a->inTerminatorDefined != b->inTerminatorDefined ||
+        a->outTerminatorDefined != b->outTerminatorDefined)
+        return false;
+    for (i = 0; i < sizeof(bufa)/sizeof(bufa[0]); i++)
+    {
+        if (bufa[i]->length() != bufb[i]->length() ||
+            memcmp((*bufa[i])(), (*bufb[i])(), bufa[i]->length()) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Compiled protocols are identified by a key which consists of the
+// StreamDevice version, protocol file name and a hash of its contents,
+// protocol name with parameters, some sizes of data types and the
+// layout of the cache file.
+// Records with equal keys share the compiled protocol.
+
+// Cache of compiled protocols (optional)
+// A cache file contains the key and everything compile() produces.
+// The cache file name is a hash of the key.
+
+const char* StreamCore::cachePath = NULL;
+
+// Increment cacheFormat whenever the cache file layout changes.
+// Files in an old layout then simply have a different key.
+static const unsigned short cacheFormat = 1;
+enum { cacheValues = 11 };  // number of settings in the cache file
+
+extern "C" const char StreamVersion [];
+
+bool StreamCore::
+protocolKey(const char* filename, const char* protocolAndParams,
+    StreamBuffer& key)
+{
+    StreamBuffer hash;
+    if (!StreamProtocolParser::getFileHash(filename, hash))
+    {
+        return false;
+    }
+    unsigned short sizes[] =
+        { sizeof(long), sizeof(size_t), sizeof(StreamFormat),
+          cacheFormat, cacheValues };
+    key.clear();
+    key.append("StreamDevice protocol cache\n");
+    key.append(StreamVersion).append('\0');
+    key.append(filename).append('\0');
+    key.append(hash).append('\0');
+    key.append(protocolAndParams).append('\0');
+    key.append(sizes, sizeof(sizes));
+    return true;
+}
+
+void StreamCore::
+cacheFile(StreamBuffer& cachefile)
+{
+    const StreamBuffer& key = building->key;
+
+    // 64 bit FNV-1a hash of the key
+    unsigned long long fnv = 14695981039346656037ULL;
+    for (long i = 0; i < key.length(); i++)
+    {
+        fnv ^= (unsigned char)key[i];
+        fnv *= 1099511628211ULL;
+    }
+    cachefile.clear();
+    cachefile.print("%s/%08lx%08lx.streamcache", cachePath,
+        (unsigned long)(fnv >> 32), (unsigned long)(fnv & 0xffffffff));
+}
+
+bool StreamCore::
+readCache()
+{
+    const StreamBuffer& key = building->key;
+    StreamBuffer cachefile;
+    StreamBuffer data;
+    char chunk[4096];
+    size_t n;
+    int i;
+
+    cacheFile(cachefile);
+    FILE* file = fopen(cachefile(), "rb");
+    if (!file)
+    {
+        debug("StreamCore::readCache(%s): %s not in cache\n",
+            name(), building->name());
+        return false;
+    }
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        data.append(chunk, n);
+    }
+    fclose(file);
+    if (data.length() < key.length() ||
+        memcmp(data(), key(), key.length()) != 0)
+    {
+        debug("StreamCore::readCache(%s): %s has different key\n",
+            name(), cachefile());
+        return false;
+    }
+
+    // check that the file is complete before using it
+    unsigned long values[cacheValues];
+    StreamBuffer* buffers[] = { &building->inTerminator,
+        &building->outTerminator, &building->separator, &building->commands,
+        &building->onInit, &building->onWriteTimeout,
+        &building->onReplyTimeout, &building->onReadTimeout,
+        &building->onMismatch };
+    const char* c = data(key.length());
+    const char* end = data.end();
+    const char* p = c + sizeof(values);
+    long length;
+    for (i = 0; i < (int)(sizeof(buffers)/sizeof(buffers[0])); i++)
+    {
+        if (p + sizeof(length) > end) break;
+        length = extract<long>(p);
+        if (length < 0 || p + length > end) break;
+        p += length;
+    }
+    if (p != end)
+    {
+        error("%s: Ignoring corrupt protocol cache file %s\n",
+            name(), cachefile());
         return false;
     }
-    delete protocol;
+
+    memcpy(values, c, sizeof(values));
+    c += sizeof(values);
+    building->ignoreExtraInput = values[0] != 0;
+    building->lockTimeout = values[1];
+    building->readTimeout = values[2];
+    building->replyTimeout = values[3];
+    building->writeTimeout = values[4];
+    building->pollPeriod = values[5];
+    building->maxInput = values[6];
+    building->inTerminatorDefined = values[7] != 0;
+    building->outTerminatorDefined = values[8] != 0;
+    building->outputChunk = values[9];
+    building->replyCache = values[10];
+    for (i = 0; i < (int)(sizeof(buffers)/sizeof(buffers[0])); i++)
+    {
+        length = extract<long>(c);
+        buffers[i]->set(c, length);
+        c += length;
+        // the cache holds optimized code only
+        if (i >= 3) building->optimizedSize += length;
+    }
+    building->codeSize = building->optimizedSize;
+    building->decodedSize = decode();
+
+    // the bus may be different from the one the cache was written for
+    for (i = 0; i < CodeCount; i++)
+    {
+        for (const Instruction* in = building->entry[i];
+            in->command != end_cmd; in++)
+        {
+            if (in->command == event_cmd && !busSupportsEvent())
+            {
+                // let compile() complain, starting from scratch
+                Compiled* fresh = new Compiled;
+                fresh->key = building->key;
+                fresh->name = building->name;
+                delete building;
+                building = fresh;
+                return false;
+            }
+        }
+    }
+    debug("StreamCore::readCache(%s): %s loaded from %s\n",
+        name(), building->name(), cachefile());
     return true;
 }
 
+void StreamCore::
+writeCache()
+{
+    static bool warned = false;
+    const StreamBuffer& key = building->key;
+    StreamBuffer cachefile;
+    StreamBuffer tmpfile;
+    int i;
+
+    // field addresses are specific to the record,
+    // info of some converters to the process
+    for (i = 0; i < CodeCount; i++)
+    {
+        for (const Instruction* in = building->entry[i];
+            in->command != end_cmd; in++)
+        {
+            if (in->command != in_cmd && in->command != out_cmd &&
+                in->command != exec_cmd) continue;
+            for (const Element* e = in->elements; e->type != Element::End; e++)
+            {
+                if (e->type == Element::Format &&
+                    (e->fieldName || !e->converter->cacheable(e->format)))
+                {
+                    debug("StreamCore::writeCache(%s): "
+                        "%s cannot be cached because of format %%%s\n",
+                        name(), building->name(), e->formatString);
+                    return;
+                }
+            }
+        }
+    }
+    cacheFile(cachefile);
+
+    unsigned long values[cacheValues] = { building->ignoreExtraInput,
+        building->lockTimeout, building->readTimeout, building->replyTimeout,
+        building->writeTimeout, building->pollPeriod, building->maxInput,
+        building->inTerminatorDefined, building->outTerminatorDefined,
+        building->outputChunk, building->replyCache };
+    StreamBuffer* buffers[] = { &building->inTerminator,
+        &building->outTerminator, &building->separator, &building->commands,
+        &building->onInit, &building->onWriteTimeout,
+        &building->onReplyTimeout, &building->onReadTimeout,
+        &building->onMismatch };
+    StreamBuffer data(key);
+    data.append(values, sizeof(values));
+    for (i = 0; i < (int)(sizeof(buffers)/sizeof(buffers[0])); i++)
+    {
+        long length = buffers[i]->length();
+        data.append(&length, sizeof(length));
+        data.append(*buffers[i]);
+    }
+
+    // write to temporary file and rename to replace files atomically
+    tmpfile.print("%s.%p%lx", cachefile(), (void*)this, (long)time(NULL));
+    FILE* file = fopen(tmpfile(), "wb");
+    if (!file)
+    {
+        if (!warned)
+        {
+            error("Cannot write protocol cache file %s: %s\n",
+                tmpfile(), strerror(errno));
+            warned = true;
+        }
+        return;
+    }
+    bool ok = fwrite(data(), 1, data.length(), file) == (size_t)data.length();
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(tmpfile(), cachefile()) != 0)
+    {
+        remove(tmpfile());
+        return;
+    }
+    debug("StreamCore::writeCache(%s): %s written to %s\n",
+        name(), building->name(), cachefile());
+}
+
 bool StreamCore::
 compile(StreamProtocolParser::Protocol* protocol)
 {
     const char* extraInputNames [] = {"error", "ignore", NULL};
 
     // default values for protocol variables
-    flags &= ~IgnoreExtraInput;
-    lockTimeout = 5000;
-    readTimeout = 100;
-    replyTimeout = 1000;
-    writeTimeout = 100;
-    maxInput = 0;
-    pollPeriod = 1000;
-    inTerminatorDefined = false;
-    outTerminatorDefined = false;
+    building->ignoreExtraInput = false;
+    building->lockTimeout = 5000;
+    building->readTimeout = 100;
+    building->replyTimeout = 1000;
+    building->writeTimeout = 100;
+    building->maxInput = 0;
+    building->outputChunk = 0;
+    building->replyCache = 0;
+    building->pollPeriod = 1000;
+    building->inTerminatorDefined = false;
+    building->outTerminatorDefined = false;
     
     unsigned short ignoreExtraInput = false;
     if (!protocol->getEnumVariable("extrainput", ignoreExtraInput,
@@ -250,36 +734,484 @@ compile(StreamProtocolParser::Protocol* protocol)
     {
         return false;
     }
-    if (ignoreExtraInput) flags |= IgnoreExtraInput;
-    if (!(protocol->getNumberVariable("locktimeout", lockTimeout) &&
-        protocol->getNumberVariable("readtimeout", readTimeout) &&
-        protocol->getNumberVariable("replytimeout", replyTimeout) &&
-        protocol->getNumberVariable("writetimeout", writeTimeout) &&
-        protocol->getNumberVariable("maxinput", maxInput) &&
+    building->ignoreExtraInput = ignoreExtraInput != 0;
+    if (!(protocol->getNumberVariable("locktimeout", building->lockTimeout) &&
+        protocol->getNumberVariable("readtimeout", building->readTimeout) &&
+        protocol->getNumberVariable("replytimeout", building->replyTimeout) &&
+        protocol->getNumberVariable("writetimeout", building->writeTimeout) &&
+        protocol->getNumberVariable("maxinput", building->maxInput) &&
+        protocol->getNumberVariable("outputchunk", building->outputChunk) &&
+        protocol->getNumberVariable("replycache", building->replyCache) &&
         // use replyTimeout as default for pollPeriod
-        protocol->getNumberVariable("replytimeout", pollPeriod) &&
-        protocol->getNumberVariable("pollperiod", pollPeriod)))
+        protocol->getNumberVariable("replytimeout", building->pollPeriod) &&
+        protocol->getNumberVariable("pollperiod", building->pollPeriod)))
     {
         return false;
     }
-    if (!(protocol->getStringVariable("terminator", inTerminator, &inTerminatorDefined) &&
-        protocol->getStringVariable("terminator", outTerminator, &outTerminatorDefined) &&
-        protocol->getStringVariable("interminator", inTerminator, &inTerminatorDefined) &&
-        protocol->getStringVariable("outterminator", outTerminator, &outTerminatorDefined) &&
-        protocol->getStringVariable("separator", separator)))
+    if (!(protocol->getStringVariable("terminator",
+            building->inTerminator, &building->inTerminatorDefined) &&
+        protocol->getStringVariable("terminator",
+            building->outTerminator, &building->outTerminatorDefined) &&
+        protocol->getStringVariable("interminator",
+            building->inTerminator, &building->inTerminatorDefined) &&
+        protocol->getStringVariable("outterminator",
+            building->outTerminator, &building->outTerminatorDefined) &&
+        protocol->getStringVariable("separator", building->separator)))
     {
         return false;
     }
-    if (!(protocol->getCommands(NULL, commands, this) &&
-        protocol->getCommands("@init", onInit, this) &&
-        protocol->getCommands("@writetimeout", onWriteTimeout, this) &&
-        protocol->getCommands("@replytimeout", onReplyTimeout, this) &&
-        protocol->getCommands("@readtimeout", onReadTimeout, this) &&
-        protocol->getCommands("@mismatch", onMismatch, this)))
+    if (!(protocol->getCommands(NULL, building->commands, this) &&
+        protocol->getCommands("@init", building->onInit, this) &&
+        protocol->getCommands("@writetimeout", building->onWriteTimeout, this) &&
+        protocol->getCommands("@replytimeout", building->onReplyTimeout, this) &&
+        protocol->getCommands("@readtimeout", building->onReadTimeout, this) &&
+        protocol->getCommands("@mismatch", building->onMismatch, this)))
     {
         return false;
     }
-    return protocol->checkUnused();
+    if (!protocol->checkUnused())
+    {
+        return false;
+    }
+    StreamBuffer* code[CodeCount] = { &building->commands, &building->onInit,
+        &building->onWriteTimeout, &building->onReplyTimeout,
+        &building->onReadTimeout, &building->onMismatch };
+    long before = 0;
+    long after = 0;
+    for (int i = 0; i < CodeCount; i++)
+    {
+        before += code[i]->length();
+        optimize(*code[i]);
+        after += code[i]->length();
+    }
+    building->codeSize = before;
+    building->optimizedSize = after;
+    building->decodedSize = decode();
+    debug("StreamCore::compile(%s): %ld bytes of code, "
+        "%ld bytes after optimization, %" P "u bytes decoded\n",
+        name(), before, after, building->decodedSize);
+    return true;
+}
+
+// Render an output string which contains no value formats.
+// Pseudo formats (e.g. checksums) only depend on the output so far
+// and are thus rendered, too. Return false if the string needs a value.
+
+static bool renderConstant(const char*& source, StreamBuffer& output)
+{
+    const char* c = source;
+    char command;
+    while ((command = *c++) != StreamProtocolParser::eos)
+    {
+        switch (command)
+        {
+            case StreamProtocolParser::format_field:
+                // field <eos> addrlen AddressStructure
+                c += strlen(c)+1;
+                c += extract<unsigned short>(c);
+            case StreamProtocolParser::format:
+            {
+                // formatstring <eos> StreamFormat [info]
+                while (*c)
+                {
+                    if (*c == esc) c++;
+                    c++;
+                }
+                c++;
+                StreamFormat fmt = extract<StreamFormat>(c);
+                fmt.info = c;
+                c += fmt.infolen;
+                if (fmt.type != pseudo_format) return false;
+                if (!StreamFormatConverter::find(fmt.conv)->
+                    printPseudo(fmt, output)) return false;
+                continue;
+            }
+            case StreamProtocolParser::whitespace:
+                output.append(' ');
+            case StreamProtocolParser::skip:
+                continue;
+            case esc:
+                command = *c++;
+            default:
+                output.append(command);
+        }
+    }
+    source = c;
+    return true;
+}
+
+// Optimize compiled code:
+// Replace 'out' commands which do not print any value by their
+// final output line (including terminator). Such commands need
+// no formatting at run time and their bytes are handed to the bus
+// interface directly.
+// code layout: const_out_cmd length bytes
+// Merge consecutive 'wait' commands and drop 'wait 0'.
+
+void StreamCore::
+optimize(StreamBuffer& code)
+{
+    if (!code) return;
+    StreamBuffer result;
+    StreamBuffer line;
+    const char* c = code();
+    const char* start;
+    size_t length;
+    unsigned long timeout;
+    int count = 0;
+    int removed = 0;
+    while (*c != end_cmd)
+    {
+        start = c;
+        switch (*c++)
+        {
+            case out_cmd:
+                if (renderConstant(c, line.clear()))
+                {
+                    line.append(building->outTerminator);
+                    length = line.length();
+                    result.append(const_out_cmd);
+                    result.append(&length, sizeof(length));
+                    result.append(line);
+                    count++;
+                    continue;
+                }
+            case in_cmd:
+            case exec_cmd:
+                c = StreamProtocolParser::printString(line.clear(), c);
+                break;
+            case wait_cmd:
+                timeout = extract<unsigned long>(c);
+                while (*c == wait_cmd)
+                {
+                    c++;
+                    timeout += extract<unsigned long>(c);
+                    removed++;
+                }
+                if (timeout)
+                {
+                    result.append(wait_cmd);
+                    result.append(&timeout, sizeof(timeout));
+                }
+                else removed++;
+                continue;
+            case connect_cmd:
+                c += sizeof(unsigned long);
+                break;
+            case event_cmd:
+                c += 2*sizeof(unsigned long);
+                break;
+        }
+        result.append(start, c-start);
+    }
+    if (!count && !removed) return;
+    result.append(end_cmd);
+    debug("StreamCore::optimize(%s): %d constant output%s, "
+        "%d command%s removed\n",
+        name(), count, count == 1 ? "" : "s",
+        removed, removed == 1 ? "" : "s");
+    code = result;
+}
+
+// Decode the compiled code into one memory block:
+// instructions, elements, field addresses, literal bytes and strings.
+// The first pass only counts the required memory, the second pass
+// fills it. Format info and field names still point to the code buffers.
+
+union Aligned { double d; void* p; long l; };
+
+static inline size_t aligned(size_t n)
+{
+    return (n+sizeof(Aligned)-1)/sizeof(Aligned)*sizeof(Aligned);
+}
+
+struct StreamCore::Decoder
+{
+    Instruction* instr;
+    Element* elem;
+    char* addr;
+    char* chars;
+    size_t instructions;
+    size_t elements;
+    size_t addresses;
+    size_t characters;
+    size_t minInput;
+    Instruction dummyInstruction;
+    Element dummyElement;
+
+    Decoder()
+        : instr(NULL), elem(NULL), addr(NULL), chars(NULL),
+        instructions(0), elements(0), addresses(0), characters(0),
+        minInput(0) {}
+
+    Instruction* instruction(unsigned char command)
+    {
+        Instruction* i = instr ? instr++ : &dummyInstruction;
+        instructions++;
+        i->eval = NULL;
+        i->command = command;
+        i->timeout = 0;
+        i->eventMask = 0;
+        i->elements = elem;
+        i->output = NULL;
+        i->outputSize = 0;
+        i->minInput = 0;
+        return i;
+    }
+
+    Element* element(Element::Type type)
+    {
+        Element* e = elem ? elem++ : &dummyElement;
+        elements++;
+        e->type = type;
+        e->length = 0;
+        e->bytes = NULL;
+        e->converter = NULL;
+        e->fieldName = NULL;
+        e->fieldAddress = NULL;
+        e->formatString = NULL;
+        return e;
+    }
+
+    const void* address(const char* source, size_t size)
+    {
+        addresses += aligned(size);
+        if (!addr) return NULL;
+        void* p = addr;
+        memcpy(p, source, size);
+        addr += aligned(size);
+        return p;
+    }
+
+    char* reserve(size_t size)
+    {
+        characters += size;
+        if (!chars) return NULL;
+        char* p = chars;
+        chars += size;
+        return p;
+    }
+};
+
+size_t StreamCore::
+decode()
+{
+    StreamBuffer* code[CodeCount] = { &building->commands, &building->onInit,
+        &building->onWriteTimeout, &building->onReplyTimeout,
+        &building->onReadTimeout, &building->onMismatch };
+    Decoder size;
+    int i;
+
+    // separator is not coded like an in or out string
+    StreamBuffer sep;
+    for (i = 0; i < building->separator.length(); i++)
+    {
+        char c = building->separator[i];
+        if (c == esc && i+1 < building->separator.length())
+            c = building->separator[++i];
+        else if (c == StreamProtocolParser::skip ||
+            c == StreamProtocolParser::whitespace)
+        {
+            sep.append(c);
+            continue;
+        }
+        if ((unsigned char)c < StreamProtocolParser::last_function_code ||
+            c == esc) sep.append(esc);
+        sep.append(c);
+    }
+
+    for (i = 0; i < CodeCount; i++)
+        decodeCode((*code[i])(), size);
+    decodeString(sep(), size, true);
+    decodeString(sep(), size, false);
+    size_t instrsize = aligned(size.instructions * sizeof(Instruction));
+    size_t elemsize = aligned(size.elements * sizeof(Element));
+
+    delete [] building->program;
+    building->program =
+        new char[instrsize + elemsize + size.addresses + size.characters];
+    Decoder d;
+    d.instr = reinterpret_cast<Instruction*>(building->program);
+    d.elem = reinterpret_cast<Element*>(building->program + instrsize);
+    d.addr = building->program + instrsize + elemsize;
+    d.chars = d.addr + size.addresses;
+    for (i = 0; i < CodeCount; i++)
+    {
+        building->entry[i] = d.instr;
+        decodeCode((*code[i])(), d);
+    }
+    building->outputSeparator = d.elem;
+    decodeString(sep(), d, true);
+    building->inputSeparator = d.elem;
+    decodeString(sep(), d, false);
+    debug("StreamCore::decode(%s): %" P "u instructions, %" P "u elements, "
+        "%" P "u bytes\n", name(), size.instructions, size.elements,
+        instrsize + elemsize + size.addresses + size.characters);
+    return instrsize + elemsize + size.addresses + size.characters;
+}
+
+void StreamCore::
+decodeCode(const char* c, Decoder& d)
+{
+    while (1)
+    {
+        Instruction* i = d.instruction(*c++);
+        switch (i->command)
+        {
+            case end_cmd:
+                i->eval = &StreamCore::evalEnd;
+                return;
+            case in_cmd:
+                i->eval = &StreamCore::evalIn;
+                c = decodeString(c, d, false);
+                i->minInput = d.minInput;
+                break;
+            case out_cmd:
+                i->eval = &StreamCore::evalOut;
+                c = decodeString(c, d, true);
+                break;
+            case const_out_cmd:
+                i->eval = &StreamCore::evalOut;
+                i->outputSize = extract<size_t>(c);
+                i->output = c;
+                c += i->outputSize;
+                break;
+            case exec_cmd:
+                i->eval = &StreamCore::evalExec;
+                c = decodeString(c, d, true);
+                break;
+            case wait_cmd:
+                i->eval = &StreamCore::evalWait;
+                i->timeout = extract<unsigned long>(c);
+                break;
+            case event_cmd:
+                i->eval = &StreamCore::evalEvent;
+                building->events = true;
+                i->eventMask = extract<unsigned long>(c);
+                i->timeout = extract<unsigned long>(c);
+                break;
+            case connect_cmd:
+                i->eval = &StreamCore::evalConnect;
+                i->timeout = extract<unsigned long>(c);
+                break;
+            case disconnect_cmd:
+                i->eval = &StreamCore::evalDisconnect;
+                break;
+        }
+    }
+}
+
+// Output strings fold whitespace into the literals and drop skips.
+// For input strings, calculate the minimal length of matching input
+// (0 if a pseudo format may modify the input). Skips only count if
+// a literal follows, because input may end before a trailing skip.
+
+const char* StreamCore::
+decodeString(const char* c, Decoder& d, bool output)
+{
+    StreamBuffer formatstring;
+    Element* e;
+    char* p;
+    bool variable = false;
+    size_t skipped = 0;
+
+    d.minInput = 0;
+    while (1)
+    {
+        switch (*c)
+        {
+            case StreamProtocolParser::eos:
+                d.element(Element::End);
+                if (variable) d.minInput = 0;
+                return c+1;
+            case StreamProtocolParser::skip:
+                if (output) break;
+                e = d.element(Element::Skip);
+                while (*c == StreamProtocolParser::skip)
+                {
+                    e->length++;
+                    c++;
+                }
+                skipped += e->length;
+                continue;
+            case StreamProtocolParser::whitespace:
+                if (output) break;
+                d.element(Element::Whitespace);
+                while (*c == StreamProtocolParser::whitespace) c++;
+                continue;
+            case StreamProtocolParser::format_field:
+            case StreamProtocolParser::format:
+            {
+                e = d.element(Element::Format);
+                if (*c++ == StreamProtocolParser::format_field)
+                {
+                    // field <eos> addrlen AddressStructure
+                    e->fieldName = c;
+                    building->shareable = false;
+                    c += strlen(c)+1;
+                    unsigned short addrlen = extract<unsigned short>(c);
+                    e->fieldAddress = d.address(c, addrlen);
+                    c += addrlen;
+                }
+                // formatstring <eos> StreamFormat [info]
+                c = StreamProtocolParser::printString(formatstring.clear(), c);
+                p = d.reserve(formatstring.length()+1);
+                if (p) memcpy(p, formatstring(), formatstring.length()+1);
+                e->formatString = p;
+                e->format = extract<StreamFormat>(c);
+                e->format.info = c;
+                c += e->format.infolen;
+                e->converter = StreamFormatConverter::find(e->format.conv);
+                if (e->format.type == pseudo_format) variable = true;
+                continue;
+            }
+        }
+        // run of literal bytes
+        e = d.element(Element::Literal);
+        const char* s = c;
+        while (1)
+        {
+            if (*s == esc) s++;
+            else if (output && *s == StreamProtocolParser::skip)
+            {
+                s++;
+                continue;
+            }
+            else if (!(output && *s == StreamProtocolParser::whitespace) &&
+                (unsigned char)*s < StreamProtocolParser::last_function_code)
+                break;
+            s++;
+            e->length++;
+        }
+        if (!output)
+        {
+            d.minInput += skipped + e->length;
+            skipped = 0;
+        }
+        p = d.reserve(e->length);
+        e->bytes = p;
+        if (!p)
+        {
+            c = s;
+            continue;
+        }
+        while (c < s)
+        {
+            switch (*c)
+            {
+                case StreamProtocolParser::skip:
+                    c++;
+                    continue;
+                case StreamProtocolParser::whitespace:
+                    *p++ = ' ';
+                    c++;
+                    continue;
+                case esc:
+                    c++;
+            }
+            *p++ = *c++;
+        }
+    }
 }
 
 bool StreamCore::
@@ -436,13 +1368,27 @@ startProtocol(StartMode startMode)
         case StartNormal:
             break;
     }
-    if (!commands)
+    if (pending)
+    {
+        // reloaded while running, see reload()
+        Compiled* replaced = compiled;
+        install(pending);
+        pending = NULL;
+        lockCompile();
+        release(replaced);
+        releaseCompile();
+    }
+    if (!compiled && !compileOnDemand())
     {
         error ("%s: No protocol loaded\n", name());
         return false;
     }
-    commandIndex = (startMode == StartInit) ? onInit() : commands();
+    if (!io) io = new IoBuffers;
+    io->replyQuery.clear();
+    commandIndex =
+        compiled->entry[startMode == StartInit ? InitCode : MainCode];
     runningHandler = Success;
+    flags |= Running;
     protocolStartHook();
     return evalCommand();
 }
@@ -470,28 +1416,29 @@ finishProtocol(ProtocolResult status)
         // save original error status
         runningHandler = status;
         // look for error handler
-        char* handler;
+        const Instruction* handler;
         switch (status)
         {
             case Success:
                 handler = NULL;
                 break;
             case WriteTimeout:
-                handler = onWriteTimeout();
+                handler = compiled->entry[WriteTimeoutCode];
                 break;
             case ReplyTimeout:
-                handler = onReplyTimeout();
+                handler = compiled->entry[ReplyTimeoutCode];
                 break;
             case ReadTimeout:
-                handler = onReadTimeout();
+                handler = compiled->entry[ReadTimeoutCode];
                 break;
             case ScanError:
-                handler = onMismatch();
+                handler = compiled->entry[MismatchCode];
                 /* reparse old input if first command in handler is 'in' */
-                if (*handler == in_cmd)
+                if (handler->command == in_cmd)
                 {
                     debug("reparsing input \"%s\"\n",
-                        inputLine.expand()());
+                        io->inputLine.expand()());
+                    activeCommand = handler;
                     commandIndex = handler + 1;
                     if (matchInput())
                     {
@@ -505,7 +1452,7 @@ finishProtocol(ProtocolResult status)
             default:
                 // get rid of all the rubbish whe might have collected
                 unparsedInput = false;
-                inputBuffer.clear();
+                if (io) io->inputBuffer.clear();
                 handler = NULL;
         }
         if (handler)
@@ -535,7 +1482,7 @@ finishProtocol(ProtocolResult status)
         flags &= ~BusOwner;
     }
     busFinish();
-    flags &= ~(AcceptInput|AcceptEvent);
+    flags &= ~(AcceptInput|AcceptEvent|Running);
     protocolFinishHook(status);
 }
 
@@ -551,39 +1498,17 @@ evalCommand()
             flags & WaitPending ? "timerCallback()" : "");
         return false;
     }
-    activeCommand = commandIndex;
+    activeCommand = commandIndex++;
     debug("StreamCore::evalCommand(%s): activeCommand = %s\n",
-        name(), commandName(*activeCommand));
-    switch (*commandIndex++)
-    {
-        case out_cmd:
-            //// flags &= ~(AcceptInput|AcceptEvent);
-            return evalOut();
-        case in_cmd:
-            //// flags &= ~AcceptEvent;
-            return evalIn();
-        case wait_cmd:
-            //// flags &= ~(AcceptInput|AcceptEvent);
-            return evalWait();
-        case event_cmd:
-            //// flags &= ~AcceptInput;
-            return evalEvent();
-        case exec_cmd:
-            return evalExec();
-        case end_cmd:
-            finishProtocol(Success);
-            return true;
-        case connect_cmd:
-            return evalConnect();
-        case disconnect_cmd:
-            return evalDisconnect();
-        default:
-            error("INTERNAL ERROR (%s): illegal command code 0x%02x\n",
-                name(), *activeCommand);
-            flags &= ~BusPending;
-            finishProtocol(Fault);
-            return false;
-    }
+        name(), commandName(activeCommand->command));
+    return (this->*activeCommand->eval)();
+}
+
+bool StreamCore::
+evalEnd()
+{
+    finishProtocol(Success);
+    return true;
 }
 
 // Handle 'out' command
@@ -593,157 +1518,374 @@ evalOut()
 {
     // flush all unread input
     unparsedInput = false;
-    inputBuffer.clear();
-    if (!formatOutput())
+    io->inputBuffer.clear();
+    io->outputResume = NULL;
+    if (activeCommand->output)
     {
-        finishProtocol(FormatError);
-        return false;
+        // precomputed at compile time, terminator included
+        outputData = activeCommand->output;
+        outputSize = activeCommand->outputSize;
     }
-    outputLine.append(outTerminator);
-    debug ("StreamCore::evalOut: outputLine = \"%s\"\n", outputLine.expand()());
-    if (*commandIndex == in_cmd)  // prepare for early input
+    else
+    {
+        if (!formatOutput(compiled->outputChunk))
+        {
+            finishProtocol(FormatError);
+            return false;
+        }
+        if (!io->outputResume)
+            io->outputLine.append(compiled->outTerminator);
+        outputData = io->outputLine();
+        outputSize = io->outputLine.length();
+    }
+#ifndef NO_TEMPORARY
+    debug ("StreamCore::evalOut: output = \"%s\"\n",
+        StreamBuffer(outputData, outputSize).expand()());
+#endif
+    io->replyQuery.clear();
+    if (compiled->replyCache && commandIndex->command == in_cmd &&
+        !io->outputResume)
+    {
+        // Another record may just have sent the same to the same bus
+        io->replyQuery.append(busKey).append('\0')
+            .append(outputData, outputSize);
+        if (cachedReply(io->replyQuery, compiled->replyCache,
+            io->inputBuffer))
+        {
+            debug ("StreamCore::evalOut(%s): cached reply \"%s\"\n",
+                name(), io->inputBuffer.expand()());
+            io->replyQuery.clear();
+            io->inputBuffer.append(compiled->inTerminator);
+            unparsedInput = true;
+            lastInputStatus = StreamIoEnd;
+            return evalCommand();
+        }
+    }
+    if (commandIndex->command == in_cmd)  // prepare for early input
     {
         flags |= AcceptInput;
     }
-    if (*commandIndex == event_cmd)  // prepare for early event
+    if (commandIndex->command == event_cmd)  // prepare for early event
     {
         flags |= AcceptEvent;
     }
     if (!(flags & BusOwner))
     {
         debug ("StreamCore::evalOut(%s): lockRequest(%li)\n",
-            name(), flags & InitRun ? 0 : lockTimeout);
+            name(), flags & InitRun ? 0 : compiled->lockTimeout);
         flags |= LockPending;
-        if (!busLockRequest(flags & InitRun ? 0 : lockTimeout))
+        if (!busLockRequest(flags & InitRun ? 0 : compiled->lockTimeout))
         {
             return false;
         }
         return true;
     }
     flags |= WritePending;
-    if (!busWriteRequest(outputLine(), outputLine.length(), writeTimeout))
+    if (!busWriteRequest(outputData, outputSize, compiled->writeTimeout))
     {
         return false;
     }
     return true;
 }
 
+// With OutputChunk, long output is formatted and written in parts
+// of about that size, so it does not need to fit into memory at once.
+// The values of a format element are only collected from the record,
+// once when the element is reached. Formatting stops when the part is
+// full and the next part continues with the next collected value.
+
 bool StreamCore::
-formatOutput()
+formatOutput(unsigned long partSize)
 {
-    char command;
-    const char* fieldName = NULL;
-    const char* formatstring;
-    int formatstringlen;
-    
-    outputLine.clear();
-    while ((command = *commandIndex++) != StreamProtocolParser::eos)
+    const Element* e = activeCommand->elements;
+    const Element* resume = NULL;
+
+    io->outputLine.clear();
+    io->outputLimit = partSize;
+    if (partSize)
     {
-        switch (command)
+        // pseudo formats like checksums need the whole line
+        for (e = activeCommand->elements; e->type != Element::End; e++)
+            if (e->type == Element::Format &&
+                e->format.type == pseudo_format) io->outputLimit = 0;
+        resume = io->outputResume;
+        e = resume ? resume : activeCommand->elements;
+    }
+    io->outputResume = NULL;
+    for (; e->type != Element::End; e++)
+    {
+        switch (e->type)
         {
-            case StreamProtocolParser::format_field:
-            {
-                debug("StreamCore::formatOutput(%s): StreamProtocolParser::redirect_format\n",
-                    name());
-                // code layout:
-                // field <eos> addrlen AddressStructure formatstring <eos> StreamFormat [info]
-                fieldName = commandIndex;
-                commandIndex += strlen(commandIndex)+1;
-                unsigned short addrlen = extract<unsigned short>(commandIndex);
-                fieldAddress.set(commandIndex, addrlen);
-                commandIndex += addrlen;
-                goto normal_format;
-            }
-            case StreamProtocolParser::format:
+            case Element::Format:
             {
-                fieldAddress.clear();
-normal_format:
-                // code layout:
-                // formatstring <eos> StreamFormat [info]
-                formatstring = commandIndex;
-                // jump after <eos>
-                while (*commandIndex)
-                {
-                    if (*commandIndex == esc) commandIndex++;
-                    commandIndex++;
-                }
-                formatstringlen = commandIndex-formatstring;
-                commandIndex++;
-                
-                StreamFormat fmt = extract<StreamFormat>(commandIndex);
-                fmt.info = commandIndex; // point to info string
-                commandIndex += fmt.infolen;
-#ifndef NO_TEMPORARY
                 debug("StreamCore::formatOutput(%s): format = %%%s\n",
-                    name(), StreamBuffer(formatstring, formatstringlen).expand()());
-#endif
-
-                if (fmt.type == pseudo_format)
+                    name(), e->formatString);
+                activeElement = e;
+                if (e->format.type == pseudo_format)
                 {
-                    if (!StreamFormatConverter::find(fmt.conv)->
-                        printPseudo(fmt, outputLine))
+                    if (!e->converter->printPseudo(e->format, io->outputLine))
                     {
                         error("%s: Can't print pseudo value '%%%s'\n",
-                            name(), formatstring);
+                            name(), e->formatString);
                         return false;
                     }
                     continue;
                 }
                 flags &= ~Separator;
-                if (!formatValue(fmt, fieldAddress ? fieldAddress() : NULL))
+                bool ok = true;
+                if (io->outputLimit)
+                {
+                    if (e != resume)
+                    {
+                        flags |= CollectOutput;
+                        io->collected.clear();
+                        io->outputNext = 0;
+                        ok = formatValue(e->format, e->fieldAddress);
+                        flags &= ~CollectOutput;
+                    }
+                    if (ok) ok = formatCollectedPart(e);
+                    if (ok && io->outputResume)
+                    {
+                        debug("StreamCore::formatOutput(%s): "
+                            "part of %ld bytes full\n",
+                            name(), io->outputLine.length());
+                        return true;
+                    }
+                }
+                else
+                {
+                    if (runParallel && formatThreads > 1 &&
+                        e->format.type != string_format)
+                    {
+                        // only collect the values, format them later
+                        flags |= CollectOutput;
+                        io->collected.clear();
+                    }
+                    ok = formatValue(e->format, e->fieldAddress);
+                    if (flags & CollectOutput)
+                    {
+                        flags &= ~CollectOutput;
+                        if (ok) ok = formatCollected(e);
+                    }
+                }
+                if (!ok)
                 {
-                    StreamBuffer formatstr(formatstring, formatstringlen);
-                    if (fieldAddress)
+                    if (e->fieldName)
                         error("%s: Cannot format field '%s' with '%%%s'\n",
-                            name(), fieldName, formatstr.expand()());
+                            name(), e->fieldName, e->formatString);
                     else
                         error("%s: Cannot format value with '%%%s'\n",
-                            name(), formatstr.expand()());
+                            name(), e->formatString);
                     return false;
                 }
                 continue;
             }
-            case StreamProtocolParser::whitespace:
-                outputLine.append(' ');
-            case StreamProtocolParser::skip:
+            case Element::Whitespace:
+                io->outputLine.append(' ');
+                continue;
+            case Element::Literal:
+                io->outputLine.append(e->bytes, e->length);
                 continue;
-            case esc:
-                // escaped literal byte
-                command = *commandIndex++;
             default:
-                // literal byte
-                outputLine.append(command);
+                continue;
         }
     }
     return true;
 }
 
+// With formatThreads, the values of long arrays are only collected by
+// printValue() and then formatted by parallel threads, each one into
+// its own buffer. The buffers are joined in order, so the output is
+// the same as formatted by printValue() directly.
+
+const long parallelFormatSize = 4096; // values worth parallel threads
+
+struct StreamCore::FormatPart
+{
+    const StreamCore* core;
+    const Element* element;
+    long first;
+    long last;
+    long failed;
+    StreamBuffer output;
+};
+
 void StreamCore::
-printSeparator()
+formatPart(void* arg)
 {
-    if (!(flags & Separator))
+    FormatPart* part = (FormatPart*)arg;
+    const StreamCore* core = part->core;
+    const Element* e = part->element;
+    const StreamFormat& fmt = e->format;
+    const StreamBuffer& values = core->io->collected;
+
+    for (long i = part->first; i < part->last; i++)
     {
-        flags |= Separator;
-        return;
+        if (i > 0)
+        {
+            for (const Element* s = core->compiled->outputSeparator;
+                s->type != Element::End; s++)
+                part->output.append(s->bytes, s->length);
+        }
+        if (fmt.type == double_format ?
+            !e->converter->printDouble(fmt, part->output,
+                ((const double*)values())[i]) :
+            !e->converter->printLong(fmt, part->output,
+                ((const long*)values())[i]))
+        {
+            part->failed = i;
+            return;
+        }
+    }
+}
+
+bool StreamCore::
+formatCollected(const Element* e)
+{
+    const StreamFormat& fmt = e->format;
+    long n = io->collected.length() / (fmt.type == double_format ?
+        sizeof(double) : sizeof(long));
+    int count = n < parallelFormatSize ? 1 : formatThreads;
+    FormatPart* parts = new FormatPart[count];
+    void** args = new void*[count];
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        parts[i].core = this;
+        parts[i].element = e;
+        parts[i].first = n * i / count;
+        parts[i].last = n * (i+1) / count;
+        parts[i].failed = -1;
+        args[i] = parts+i;
+    }
+    debug("StreamCore::formatCollected(%s): %ld values in %d parts\n",
+        name(), n, count);
+    if (count > 1)
+        runParallel(formatPart, args, count);
+    else
+        formatPart(parts);
+    for (i = 0; i < count; i++)
+    {
+        long failed = parts[i].failed;
+        if (failed >= 0)
+        {
+            if (fmt.type == double_format)
+                error("%s: Formatting value %#g failed\n",
+                    name(), ((const double*)io->collected())[failed]);
+            else
+                error("%s: Formatting value %li failed\n",
+                    name(), ((const long*)io->collected())[failed]);
+            ok = false;
+            break;
+        }
+        io->outputLine.append(parts[i].output);
     }
-    if (!separator) return;
-    long i = 0;
-    for (; i < separator.length(); i++)
+    if (n) flags |= Separator;
+    delete [] args;
+    delete [] parts;
+    return ok;
+}
+
+// Formats the collected values from where the last part stopped until
+// the current part is full. Then sets outputResume to continue there.
+bool StreamCore::
+formatCollectedPart(const Element* e)
+{
+    const StreamFormat& fmt = e->format;
+    const char* values = io->collected();
+    long end = io->collected.length();
+    long pos;
+    bool ok;
+
+    while ((pos = io->outputNext) < end)
     {
-        switch (separator[i])
+        if (io->outputLine.length() >= io->outputLimit)
         {
-            case StreamProtocolParser::whitespace:
-                outputLine.append(' '); // print single space
-            case StreamProtocolParser::skip:
-                continue;
-            case esc:
-                // escaped literal byte
-                i++;
+            // part is full, continue here with the next one
+            io->outputResume = e;
+            return true;
+        }
+        if (pos > 0)
+        {
+            for (const Element* s = compiled->outputSeparator;
+                s->type != Element::End; s++)
+                io->outputLine.append(s->bytes, s->length);
+        }
+        switch (fmt.type)
+        {
+            case double_format:
+                io->outputNext += sizeof(double);
+                ok = e->converter->printDouble(fmt, io->outputLine,
+                    *(const double*)(values+pos));
+                if (!ok)
+                    error("%s: Formatting value %#g failed\n",
+                        name(), *(const double*)(values+pos));
+                break;
+            case string_format:
+                io->outputNext += strlen(values+pos) + 1;
+                ok = e->converter->printString(fmt, io->outputLine,
+                    values+pos);
+                if (!ok)
+                {
+                    StreamBuffer buffer(values+pos);
+                    error("%s: Formatting value \"%s\" failed\n",
+                        name(), buffer.expand()());
+                }
+                break;
             default:
-                // literal byte
-                outputLine.append(separator[i]);
+                io->outputNext += sizeof(long);
+                ok = e->converter->printLong(fmt, io->outputLine,
+                    *(const long*)(values+pos));
+                if (!ok)
+                    error("%s: Formatting value %li failed\n",
+                        name(), *(const long*)(values+pos));
+                break;
         }
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// Formats and writes the next part of long output
+bool StreamCore::
+writeOutputPart()
+{
+    if (!formatOutput(compiled->outputChunk))
+    {
+        finishProtocol(FormatError);
+        return false;
+    }
+    if (!io->outputResume)
+        io->outputLine.append(compiled->outTerminator);
+    outputData = io->outputLine();
+    outputSize = io->outputLine.length();
+#ifndef NO_TEMPORARY
+    debug ("StreamCore::writeOutputPart: output = \"%s\"\n",
+        StreamBuffer(outputData, outputSize).expand()());
+#endif
+    flags |= WritePending;
+    if (!busWriteRequest(outputData, outputSize, compiled->writeTimeout))
+    {
+        finishProtocol(Fault);
+        return false;
+    }
+    return true;
+}
+
+void StreamCore::
+printSeparator()
+{
+    if (!(flags & Separator))
+    {
+        flags |= Separator;
+        return;
     }
+    // output separator is folded into literals
+    for (const Element* e = compiled->outputSeparator;
+        e->type != Element::End; e++)
+        io->outputLine.append(e->bytes, e->length);
 }
 
 bool StreamCore::
@@ -755,16 +1897,21 @@ printValue(const StreamFormat& fmt, long value)
             name(), fmt.conv);
         return false;
     }
+    if (flags & CollectOutput)
+    {
+        io->collected.append(&value, sizeof(value));
+        return true;
+    }
     printSeparator();
-    if (!StreamFormatConverter::find(fmt.conv)->
-        printLong(fmt, outputLine, value))
+    if (!converter(fmt)->
+        printLong(fmt, io->outputLine, value))
     {
         error("%s: Formatting value %li failed\n",
             name(), value);
         return false;
     }
     debug("StreamCore::printValue %s %%%c long %ld (%lx): \"%s\"\n",
-        name(), fmt.conv, value, value, outputLine.expand()());
+        name(), fmt.conv, value, value, io->outputLine.expand()());
     return true;
 }
 
@@ -777,16 +1924,21 @@ printValue(const StreamFormat& fmt, double value)
             name(), fmt.conv);
         return false;
     }
+    if (flags & CollectOutput)
+    {
+        io->collected.append(&value, sizeof(value));
+        return true;
+    }
     printSeparator();
-    if (!StreamFormatConverter::find(fmt.conv)->
-        printDouble(fmt, outputLine, value))
+    if (!converter(fmt)->
+        printDouble(fmt, io->outputLine, value))
     {
         error("%s: Formatting value %#g failed\n",
             name(), value);
         return false;
     }
     debug("StreamCore::printValue %s %%%c double %#g: \"%s\"\n",
-        name(), fmt.conv, value, outputLine.expand()());
+        name(), fmt.conv, value, io->outputLine.expand()());
     return true;
 }
 
@@ -799,9 +1951,14 @@ printValue(const StreamFormat& fmt, char* value)
             name(), fmt.conv);
         return false;
     }
+    if (flags & CollectOutput)
+    {
+        io->collected.append(value, strlen(value)+1);
+        return true;
+    }
     printSeparator();
-    if (!StreamFormatConverter::find(fmt.conv)->
-        printString(fmt, outputLine, value))
+    if (!converter(fmt)->
+        printString(fmt, io->outputLine, value))
     {
         StreamBuffer buffer(value);
         error("%s: Formatting value \"%s\" failed\n",
@@ -809,7 +1966,7 @@ printValue(const StreamFormat& fmt, char* value)
         return false;
     }
     debug("StreamCore::printValue %s %%%c char* \"%s\"): \"%s\"\n",
-        name(), fmt.conv, value, outputLine.expand()());
+        name(), fmt.conv, value, io->outputLine.expand()());
     return true;
 }
 
@@ -833,7 +1990,7 @@ lockCallback(StreamIoStatus status)
             break;
         case StreamIoTimeout:
             debug("%s: length, within %ld ms, device seems to be busy\n",
-                name(), lockTimeout);
+                name(), compiled->lockTimeout);
             flags &= ~BusOwner;
             finishProtocol(LockTimeout);
             return;
@@ -851,7 +2008,7 @@ lockCallback(StreamIoStatus status)
             return;
     }
     flags |= WritePending;
-    if (!busWriteRequest(outputLine(), outputLine.length(), writeTimeout))
+    if (!busWriteRequest(outputData, outputSize, compiled->writeTimeout))
     {
         finishProtocol(Fault);
     }
@@ -875,16 +2032,21 @@ writeCallback(StreamIoStatus status)
         finishProtocol(WriteTimeout);
         return;
     }
+    if (io && io->outputResume)
+    {
+        writeOutputPart();
+        return;
+    }
     evalCommand();
 }
 
 const char* StreamCore::
 getOutTerminator(size_t& length)
 {
-    if (outTerminatorDefined)
+    if (compiled->outTerminatorDefined)
     {
-        length = outTerminator.length();
-        return outTerminator();
+        length = compiled->outTerminator.length();
+        return compiled->outTerminator();
     }
     else
     {
@@ -895,18 +2057,23 @@ getOutTerminator(size_t& length)
 
 // Handle 'in' command
 
+const long prescanSize = 4096; // input length worth a prescan()
+const long parallelScanSize = 65536; // worth a parallelScan()
+
 bool StreamCore::
 evalIn()
 {
     flags |= AcceptInput;
     long expectedInput;
 
-    expectedInput = maxInput;
+    resetPrescan();
+
+    expectedInput = compiled->maxInput;
     if (unparsedInput)
     {
         // handle early input
         debug("StreamCore::evalIn(%s): early input: %s\n",
-            name(), inputBuffer.expand()());
+            name(), io->inputBuffer.expand()());
         expectedInput = readCallback(lastInputStatus, NULL, 0);
         if (!expectedInput)
         {
@@ -924,11 +2091,11 @@ evalIn()
             busUnlock();
             flags &= ~BusOwner;
         }
-        busReadRequest(pollPeriod, readTimeout,
+        busReadRequest(compiled->pollPeriod, compiled->readTimeout,
             expectedInput, true);
         return true;
     }
-    busReadRequest(replyTimeout, readTimeout,
+    busReadRequest(compiled->replyTimeout, compiled->readTimeout,
         expectedInput, false);
     // continue with readCallback() in another thread
     return true;
@@ -973,7 +2140,7 @@ readCallback(StreamIoStatus status,
         case StreamIoTimeout:
             // timeout is valid end if we have no terminator
             // and number of input bytes is not limited
-            if (!inTerminator && !maxInput)
+            if (!compiled->inTerminator && !compiled->maxInput)
             {
                 status = StreamIoEnd;
             }
@@ -992,36 +2159,53 @@ readCallback(StreamIoStatus status,
                 return 0;
             }
             debug("StreamCore::readCallback(%s): No reply from device within %ld ms\n",
-                name(), replyTimeout);
-            inputBuffer.clear();
+                name(), compiled->replyTimeout);
+            io->inputBuffer.clear();
             finishProtocol(ReplyTimeout);
             return 0;
         case StreamIoFault:
             error("%s: I/O error after reading %"P"d byte%s: \"%s%s\"\n",
                 name(),
-                inputBuffer.length(), inputBuffer.length()==1 ? "" : "s",
-                inputBuffer.length() > 20 ? "..." : "",
-                inputBuffer.expand(-20,20)());
+                io->inputBuffer.length(), io->inputBuffer.length()==1 ? "" : "s",
+                io->inputBuffer.length() > 20 ? "..." : "",
+                io->inputBuffer.expand(-20,20)());
             finishProtocol(Fault);
             return 0;
     }
-    inputBuffer.append(input, size);
+    if (input && !io->inputBuffer && activeCommand->command == in_cmd &&
+        compiled->inTerminator && !compiled->maxInput)
+    {
+        // If the chunk holds a complete line, copy only that line to
+        // inputLine and keep what follows. Each listener still makes
+        // its own copy; this only saves the append to inputBuffer.
+        long end = findTerminator(static_cast<const char*>(input), size);
+        if (end >= 0)
+        {
+            long next = end + compiled->inTerminator.length();
+            io->inputLine.set(input, end);
+            io->inputBuffer.set(static_cast<const char*>(input) + next,
+                size - next);
+            if (status == StreamIoTimeout)
+                status = StreamIoEnd;
+            return matchLine(status, 0);
+        }
+    }
+    io->inputBuffer.append(input, size);
     debug("StreamCore::readCallback(%s) inputBuffer=\"%s\", size %"P"d\n",
-        name(), inputBuffer.expand()(), inputBuffer.length());
-    if (*activeCommand != in_cmd)
+        name(), io->inputBuffer.expand()(), io->inputBuffer.length());
+    if (activeCommand->command != in_cmd)
     {
         // early input, stop here and wait for in command
         // -- Should we limit size of inputBuffer? --
-        if (inputBuffer) unparsedInput = true;
+        if (io->inputBuffer) unparsedInput = true;
         return 0;
     }
     
     // prepare to parse the input
-    const char *commandStart = commandIndex;
     long end = -1;
     long termlen = 0;
     
-    if (inTerminator)
+    if (compiled->inTerminator)
     {
         // look for terminator
         // performance issue for long inputs that come in chunks:
@@ -1041,18 +2225,19 @@ readCallback(StreamIoStatus status,
             // already parsed chunks in inputBuffer
             // start parsing at beginning of new data
             // but beware of split terminators
-            start = inputBuffer.length() - size - inTerminator.length();
+            start = io->inputBuffer.length() - size -
+                compiled->inTerminator.length();
             if (start < 0) start = 0;
         }
-        end = inputBuffer.find(inTerminator, start);
+        end = io->inputBuffer.find(compiled->inTerminator, start);
         if (end >= 0)
         {
-            termlen = inTerminator.length();
+            termlen = compiled->inTerminator.length();
             debug("StreamCore::readCallback(%s) inTerminator %s at position %ld\n",
-                name(), inTerminator.expand()(), end);
+                name(), compiled->inTerminator.expand()(), end);
         } else {
             debug("StreamCore::readCallback(%s) inTerminator %s not found\n",
-                name(), inTerminator.expand()());
+                name(), compiled->inTerminator.expand()());
         }
     }
     if (status == StreamIoEnd && end < 0)
@@ -1060,19 +2245,20 @@ readCallback(StreamIoStatus status,
         // no terminator but end flag
         debug("StreamCore::readCallback(%s) end flag received\n",
             name());
-        end = inputBuffer.length();
+        end = io->inputBuffer.length();
     }
-    if (maxInput && end < 0 && (long)maxInput <= inputBuffer.length())
+    if (compiled->maxInput && end < 0 &&
+        (long)compiled->maxInput <= io->inputBuffer.length())
     {
         // no terminator but maxInput bytes read
         debug("StreamCore::readCallback(%s) maxInput size reached\n",
             name());
-        end = maxInput;
+        end = compiled->maxInput;
     }
-    if (maxInput && end > (long)maxInput)
+    if (compiled->maxInput && end > (long)compiled->maxInput)
     {
         // limit input length to maxInput (ignore terminator)
-        end = maxInput;
+        end = compiled->maxInput;
         termlen = 0;
     }
     if (end >= 0)
@@ -1090,20 +2276,21 @@ readCallback(StreamIoStatus status,
             debug("StreamCore::readCallback(%s) wait for more input\n",
                 name());
             flags |= AcceptInput;
-            if (maxInput)
-                return maxInput - inputBuffer.length();
+            if (!unparsedInput && io->inputBuffer.length() >= prescanSize)
+                prescan();
+            if (compiled->maxInput)
+                return compiled->maxInput - io->inputBuffer.length();
             else
                 return -1;
         }
         // try to parse what we got
-        end = inputBuffer.length();
+        end = io->inputBuffer.length();
         if (flags & AsyncMode)
         {
             debug("StreamCore::readCallback(%s) async timeout: just restart\n",
                 name());
             unparsedInput = false;
-            inputBuffer.clear();
-            commandIndex = commandStart;
+            io->inputBuffer.clear();
             evalIn();
             return 0;
         }
@@ -1111,19 +2298,56 @@ readCallback(StreamIoStatus status,
         {
             error("%s: Timeout after reading %ld byte%s \"%s%s\"\n",
                 name(), end, end==1 ? "" : "s", end > 20 ? "..." : "",
-                inputBuffer.expand(-20)());
+                io->inputBuffer.expand(-20)());
         }
     }
 
-    inputLine.set(inputBuffer(), end);
+    io->inputLine.set(io->inputBuffer(), end);
+    return matchLine(status, end + termlen);
+}
+
+// Returns the position of the input terminator in input or -1
+long StreamCore::
+findTerminator(const char* input, long size) const
+{
+    const StreamBuffer& term = compiled->inTerminator;
+    const char* p = input;
+    const char* last;
+
+    if (size < term.length()) return -1;
+    last = input + size - term.length();
+    while (p <= last)
+    {
+        p = static_cast<const char*>(memchr(p, term[0], last - p + 1));
+        if (!p) break;
+        if (memcmp(p, term(), term.length()) == 0) return p - input;
+        p++;
+    }
+    return -1;
+}
+
+// Matches io->inputLine and removes consumed bytes from io->inputBuffer
+long StreamCore::
+matchLine(StreamIoStatus status, long consumed)
+{
     debug("StreamCore::readCallback(%s) input line: \"%s\"\n",
-        name(), inputLine.expand()());
+        name(), io->inputLine.expand()());
+    if (runParallel && scanThreads > 1 &&
+        io->inputLine.length() >= parallelScanSize)
+        parallelScan();
+    if (io->replyQuery && status != StreamIoTimeout)
+    {
+        // the reply to the preceding out command
+        storeReply(io->replyQuery, io->inputLine, compiled->replyCache);
+        io->replyQuery.clear();
+    }
     bool matches = matchInput();
-    inputBuffer.remove(end + termlen);
-    if (inputBuffer)
+    resetPrescan();
+    io->inputBuffer.remove(consumed);
+    if (io->inputBuffer)
     {
         debug("StreamCore::readCallback(%s) unpared input left: \"%s\"\n",
-            name(), inputBuffer.expand()());
+            name(), io->inputBuffer.expand()());
         unparsedInput = true;
     }
     else
@@ -1142,7 +2366,6 @@ readCallback(StreamIoStatus status,
         {
             debug("StreamCore::readCallback(%s) async match failure: just restart\n",
                 name());
-            commandIndex = commandStart;
             evalIn();
             return 0;
         }
@@ -1164,51 +2387,306 @@ readCallback(StreamIoStatus status,
     return 0;
 }
 
+// Parse array values of long input while the rest is still arriving.
+// Only complete values (followed by a complete separator) are parsed.
+// They are stored with their position in the input, so that
+// scanValue() can use them when matchInput() gets there, instead of
+// parsing the whole line again after the last chunk has arrived.
+// The input is kept to match everything else in the usual way.
+
+void StreamCore::
+prescan()
+{
+    long pos = io->prescanPos;
+
+    if (pos < 0) return;
+    if (!io->prescanFormat)
+    {
+        pos = prescanStart(io->inputBuffer);
+        if (pos < 0)
+        {
+            io->prescanPos = -1;
+            return;
+        }
+    }
+    if (prescanValues(io->inputBuffer, pos, 0, io->prescanned) < 0)
+        pos = -1;
+    debug("StreamCore::prescan(%s): %ld values, next at %ld\n",
+        name(), (long)(io->prescanned.length() / sizeof(Prescanned)), pos);
+    io->prescanPos = pos;
+}
+
+// Returns the position of the first array value or -1 if the input
+// cannot be prescanned.
+long StreamCore::
+prescanStart(const StreamBuffer& input)
+{
+    const Element* e;
+    long pos = 0;
+
+    // The first format must be an array of numbers with a separator
+    // and only literals may precede it.
+    for (e = activeCommand->elements; e->type == Element::Literal; e++)
+    {
+        if (input.length() < pos + (long)e->length ||
+            memcmp(e->bytes, input(pos), e->length) != 0) return -1;
+        pos += e->length;
+    }
+    if (e->type != Element::Format ||
+        e->format.flags & (skip_flag|fix_width_flag) ||
+        (e->format.type != signed_format &&
+        e->format.type != unsigned_format &&
+        e->format.type != enum_format &&
+        e->format.type != double_format))
+        return -1;
+    if (!prescanLiteral())
+    {
+        // without a literal we cannot know where a value ends
+        return -1;
+    }
+    io->prescanFormat = e;
+    return pos;
+}
+
+// Returns the first literal of the input separator or NULL
+const StreamCore::Element* StreamCore::
+prescanLiteral()
+{
+    for (const Element* e = compiled->inputSeparator;
+        e->type != Element::End; e++)
+        if (e->type == Element::Literal) return e;
+    return NULL;
+}
+
+// Parses values starting at pos until the next value would start
+// at or after stop (if not 0). Moves pos to the next value.
+// Returns 1 when stop is reached, 0 at the end of the input and
+// -1 when no further value can be found.
+// Called by parallel threads: must not modify anything but its arguments.
+int StreamCore::
+prescanValues(const StreamBuffer& input, long& pos, long stop,
+    StreamBuffer& values) const
+{
+    const Element* e = io->prescanFormat;
+    const StreamFormat& fmt = e->format;
+    while (!stop || pos < stop)
+    {
+        Prescanned value;
+        long next;
+
+        value.start = pos;
+        if (fmt.type == double_format)
+            next = e->converter->scanDouble(fmt, input(pos), value.dval);
+        else
+            next = e->converter->scanLong(fmt, input(pos), value.lval);
+        if (next <= 0)
+        {
+            // maybe only the beginning of the value has arrived yet
+            return input.length() - pos < 64 ? 0 : -1;
+        }
+        value.end = pos + next;
+        // the value may be incomplete unless a separator follows
+        next = matchPrescanSeparator(input, value.end,
+            compiled->inputSeparator);
+        if (next == -2) return 0;
+        if (next < 0) return -1;
+        values.append(&value, sizeof(value));
+        pos = next;
+    }
+    return 1;
+}
+
+// Matches the separator elements from e on at pos.
+// Returns position after separator, -1 on mismatch, -2 if incomplete.
+long StreamCore::
+matchPrescanSeparator(const StreamBuffer& input, long pos,
+    const Element* e) const
+{
+    for (; e->type != Element::End; e++)
+    {
+        switch (e->type)
+        {
+            case Element::Skip:
+                pos += e->length;
+                if (pos > input.length()) return -2;
+                continue;
+            case Element::Whitespace:
+                while (pos < input.length() && isspace(input[pos])) pos++;
+                if (pos == input.length()) return -2;
+                continue;
+            default:
+                if (input.length() - pos < (long)e->length)
+                    return memcmp(e->bytes, input(pos),
+                        input.length() - pos) == 0 ? -2 : -1;
+                if (memcmp(e->bytes, input(pos), e->length) != 0)
+                    return -1;
+                pos += e->length;
+        }
+    }
+    return pos;
+}
+
+// Parse the rest of long array input in parallel threads before
+// matchInput() runs. The line is split where a separator seems to be,
+// each part is parsed by one thread. A part is only used if the
+// previous part ended exactly where it starts. Thus the cached values
+// are always the same the serial parser would find and everything
+// after the first problem is left to the serial parser.
+
+// The threads are provided by the system specific layer.
+int StreamCore::scanThreads = 0;
+int StreamCore::formatThreads = 0;
+void (*StreamCore::runParallel)(void (*)(void*), void* [], int) = NULL;
+
+struct StreamCore::ScanPart
+{
+    const StreamCore* core;
+    long start;
+    long stop;
+    long pos;
+    int status;
+    StreamBuffer values;
+};
+
+void StreamCore::
+scanPart(void* arg)
+{
+    ScanPart* part = (ScanPart*)arg;
+    const StreamCore* core = part->core;
+    part->status = core->prescanValues(core->io->inputLine,
+        part->pos, part->stop, part->values);
+}
+
+void StreamCore::
+parallelScan()
+{
+    const StreamBuffer& input = io->inputLine;
+    long pos = io->prescanPos;
+    const Element* literal;
+    int n = scanThreads;
+    int i;
+
+    if (pos < 0) return;
+    if (!io->prescanFormat)
+    {
+        pos = prescanStart(input);
+        if (pos < 0)
+        {
+            io->prescanPos = -1;
+            return;
+        }
+    }
+    if (input.length() - pos < parallelScanSize) return;
+    literal = prescanLiteral();
+    ScanPart* parts = new ScanPart[n];
+    void** args = new void*[n];
+    long size = (input.length() - pos) / n;
+    parts[0].start = parts[0].pos = pos;
+    for (i = 0; i < n; i++)
+    {
+        parts[i].core = this;
+        parts[i].stop = 0;
+        args[i] = parts+i;
+        if (i == 0) continue;
+        // find a value start after the next separator literal
+        long p = parts[i-1].start + size;
+        long start = -1;
+        while ((p = input.find(literal->bytes, literal->length, p)) >= 0)
+        {
+            start = matchPrescanSeparator(input, p + literal->length,
+                literal + 1);
+            if (start >= 0) break;
+            p++;
+        }
+        if (p < 0 || start < 0) break;
+        parts[i].start = parts[i].pos = parts[i-1].stop = start;
+    }
+    n = i;
+    debug("StreamCore::parallelScan(%s): %ld bytes from %ld in %d parts\n",
+        name(), input.length() - pos, pos, n);
+    runParallel(scanPart, args, n);
+    for (i = 0; i < n; i++)
+    {
+        io->prescanned.append(parts[i].values);
+        // stop at the first part which does not end where the next starts
+        if (parts[i].status < 0) { pos = -1; break; }
+        pos = parts[i].pos;
+        if (i+1 < n && (parts[i].status == 0 || pos != parts[i+1].start))
+            break;
+    }
+    debug("StreamCore::parallelScan(%s): %ld values\n",
+        name(), (long)(io->prescanned.length() / sizeof(Prescanned)));
+    io->prescanPos = pos;
+    delete [] args;
+    delete [] parts;
+}
+
+void StreamCore::
+resetPrescan()
+{
+    if (!io->prescanFormat && !io->prescanPos) return;
+    io->prescanned.clear();
+    io->prescanFormat = NULL;
+    io->prescanPos = 0;
+    io->prescanNext = 0;
+}
+
+// Returns value prescanned at the current input position or NULL
+const StreamCore::Prescanned* StreamCore::
+prescannedValue(const StreamFormat& fmt)
+{
+    if (!io->prescanFormat || &fmt != &io->prescanFormat->format)
+        return NULL;
+    const Prescanned* values = (const Prescanned*)io->prescanned();
+    long n = io->prescanned.length() / sizeof(Prescanned);
+    while (io->prescanNext < n &&
+        values[io->prescanNext].start < consumedInput) io->prescanNext++;
+    if (io->prescanNext == n) return NULL;
+    const Prescanned* value = values + io->prescanNext;
+    if (value->start != consumedInput ||
+        value->end > io->inputLine.length()) return NULL;
+    io->prescanNext++;
+    return value;
+}
+
 bool StreamCore::
-matchInput()
+reportMismatch()
 {
     /* Don't write messages about matching errors if either in asynchronous
        mode (then we just wait for new matching input) or if @mismatch handler
        is installed and starts with 'in' (then we reparse the input).
     */
-    char command;
-    const char* fieldName = NULL;
-    StreamBuffer formatstring;
+    return !(flags & AsyncMode) &&
+        compiled->entry[MismatchCode]->command != in_cmd;
+}
+
+bool StreamCore::
+matchInput()
+{
+    const Element* e;
+    long i;
     
     consumedInput = 0;
     
-    while ((command = *commandIndex++) != StreamProtocolParser::eos)
+    if (io->inputLine.length() < (long)activeCommand->minInput &&
+        !reportMismatch())
     {
-        switch (command)
+        // too short to match: don't bother parsing
+        debug("StreamCore::matchInput(%s): input shorter than %" P "u bytes\n",
+            name(), activeCommand->minInput);
+        return false;
+    }
+    for (e = activeCommand->elements; e->type != Element::End; e++)
+    {
+        switch (e->type)
         {
-            case StreamProtocolParser::format_field:
-            {
-                // code layout:
-                // field <StreamProtocolParser::eos> addrlen AddressStructure formatstring <StreamProtocolParser::eos> StreamFormat [info]
-                fieldName = commandIndex;
-                commandIndex += strlen(commandIndex)+1;
-                unsigned short addrlen = extract<unsigned short>(commandIndex);
-                fieldAddress.set(commandIndex, addrlen);
-                commandIndex += addrlen;
-                goto normal_format;
-            }
-            case StreamProtocolParser::format:
+            case Element::Format:
             {
-                fieldAddress.clear();
-normal_format:
                 int consumed;
-                // code layout:
-                // formatstring <eos> StreamFormat [info]
-                formatstring.clear();
-                commandIndex = StreamProtocolParser::printString(formatstring, commandIndex);
-                
-                StreamFormat fmt = extract<StreamFormat>(commandIndex);
-                fmt.info = commandIndex; // point to info string
-                commandIndex += fmt.infolen;
-#ifndef NO_TEMPORARY
+                const StreamFormat& fmt = e->format;
                 debug("StreamCore::matchInput(%s): format = \"%%%s\"\n",
-                    name(), formatstring());
-#endif
+                    name(), e->formatString);
+                activeElement = e;
 
                 if (fmt.flags & skip_flag || fmt.type == pseudo_format)
                 {
@@ -1219,21 +2697,21 @@ normal_format:
                         case unsigned_format:
                         case signed_format:
                         case enum_format:
-                            consumed = StreamFormatConverter::find(fmt.conv)->
-                                scanLong(fmt, inputLine(consumedInput), ldummy);
+                            consumed = e->converter->
+                                scanLong(fmt, io->inputLine(consumedInput), ldummy);
                             break;
                         case double_format:
-                            consumed = StreamFormatConverter::find(fmt.conv)->
-                                scanDouble(fmt, inputLine(consumedInput), ddummy);
+                            consumed = e->converter->
+                                scanDouble(fmt, io->inputLine(consumedInput), ddummy);
                             break;
                         case string_format:
-                            consumed = StreamFormatConverter::find(fmt.conv)->
-                                scanString(fmt, inputLine(consumedInput), NULL, 0);
+                            consumed = e->converter->
+                                scanString(fmt, io->inputLine(consumedInput), NULL, 0);
                             break;
                         case pseudo_format:
                             // pass complete input
-                            consumed = StreamFormatConverter::find(fmt.conv)->
-                                scanPseudo(fmt, inputLine, consumedInput);
+                            consumed = e->converter->
+                                scanPseudo(fmt, io->inputLine, consumedInput);
                             break;
                         default:
                             error("INTERNAL ERROR (%s): illegal format.type 0x%02x\n",
@@ -1248,12 +2726,12 @@ normal_format:
                         }
                         else
                         {
-                            if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                            if (reportMismatch())
                             {
                                 error("%s: Input \"%s%s\" does not match format \"%%%s\"\n",
-                                    name(), inputLine.expand(consumedInput, 20)(),
-                                    inputLine.length()-consumedInput > 20 ? "..." : "",
-                                    formatstring());
+                                    name(), io->inputLine.expand(consumedInput, 20)(),
+                                    io->inputLine.length()-consumedInput > 20 ? "..." : "",
+                                    e->formatString);
                             }
                             return false;
                         }
@@ -1263,147 +2741,146 @@ normal_format:
                 }
                 if (fmt.flags & compare_flag)
                 {
-                    outputLine.clear();
+                    io->outputLine.clear();
                     flags &= ~Separator;
-                    if (!formatValue(fmt, fieldAddress ? fieldAddress() : NULL))
+                    if (!formatValue(fmt, e->fieldAddress))
                     {
-                        if (fieldAddress)
+                        if (e->fieldName)
                             error("%s: Cannot format variable \"%s\" with \"%%%s\"\n",
-                                name(), fieldName, formatstring());
+                                name(), e->fieldName, e->formatString);
                         else
                             error("%s: Cannot format value with \"%%%s\"\n",
-                                name(), formatstring());
+                                name(), e->formatString);
                         return false;
                     }
 #ifndef NO_TEMPORARY
                     debug("StreamCore::matchInput(%s): compare \"%s\" with \"%s\"\n",
-                        name(), inputLine.expand(consumedInput,
-                            outputLine.length())(), outputLine.expand()()); 
+                        name(), io->inputLine.expand(consumedInput,
+                            io->outputLine.length())(), io->outputLine.expand()()); 
 #endif
-                    if (inputLine.length() - consumedInput < outputLine.length())
+                    if (io->inputLine.length() - consumedInput < io->outputLine.length())
                     {
-                        if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                        if (reportMismatch())
                         {
                             error("%s: Input \"%s%s\" too short."
                                   " No match for format \"%%%s\" (\"%s\")\n",
                                 name(), 
-                                inputLine.length() > 20 ? "..." : "",
-                                inputLine.expand(-20)(),
-                                formatstring(),
-                                outputLine.expand()());
+                                io->inputLine.length() > 20 ? "..." : "",
+                                io->inputLine.expand(-20)(),
+                                e->formatString,
+                                io->outputLine.expand()());
                         }
                         return false;
                     }
-                    if (!outputLine.startswith(inputLine(consumedInput),outputLine.length()))
+                    if (!io->outputLine.startswith(io->inputLine(consumedInput),io->outputLine.length()))
                     {
-                        if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                        if (reportMismatch())
                         {
                             error("%s: Input \"%s%s\" does not match format \"%%%s\" (\"%s\")\n",
-                                name(), inputLine.expand(consumedInput, 20)(),
-                                inputLine.length()-consumedInput > 20 ? "..." : "",
-                                formatstring(),
-                                outputLine.expand()());
+                                name(), io->inputLine.expand(consumedInput, 20)(),
+                                io->inputLine.length()-consumedInput > 20 ? "..." : "",
+                                e->formatString,
+                                io->outputLine.expand()());
                         }
                         return false;
                     }
-                    consumedInput += outputLine.length();
+                    consumedInput += io->outputLine.length();
                     break;
                 }
                 flags &= ~Separator;
-                if (!matchValue(fmt, fieldAddress ? fieldAddress() : NULL))
+                if (!matchValue(fmt, e->fieldAddress))
                 {
-                    if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                    if (reportMismatch())
                     {
                         if (flags & ScanTried)
                             error("%s: Input \"%s%s\" does not match format \"%%%s\"\n",
-                                name(), inputLine.expand(consumedInput, 20)(),
-                                inputLine.length()-consumedInput > 20 ? "..." : "",
-                                formatstring());
+                                name(), io->inputLine.expand(consumedInput, 20)(),
+                                io->inputLine.length()-consumedInput > 20 ? "..." : "",
+                                e->formatString);
                         else
                             error("%s: Format \"%%%s\" has data type %s which does not match the type of \"%s\".\n",
-                                name(), formatstring(), StreamFormatTypeStr[fmt.type], fieldAddress ? fieldName : name());
+                                name(), e->formatString, StreamFormatTypeStr[fmt.type],
+                                e->fieldName ? e->fieldName : name());
                     }
                     return false;
                 }
                 // matchValue() has already removed consumed bytes from inputBuffer
                 break;
             }
-            case StreamProtocolParser::skip:
-                // ignore next input byte
-                consumedInput++;
+            case Element::Skip:
+                // ignore next input bytes (a run of \? is one element)
+                consumedInput += e->length;
                 break;
-            case StreamProtocolParser::whitespace:
+            case Element::Whitespace:
                 // any number of whitespace (including 0)
-                while (isspace(inputLine[consumedInput])) consumedInput++;
+                while (isspace(io->inputLine[consumedInput])) consumedInput++;
                 break;
-            case esc:
-                // escaped literal byte
-                command = *commandIndex++;
-            default:
-                // literal byte
-                if (consumedInput >= inputLine.length())
+            case Element::Literal:
+                // literal bytes
+                for (i = 0; i < (long)e->length; i++, consumedInput++)
                 {
-                    int i = 0;
-                    while (commandIndex[i] >= ' ') i++;
-                    if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                    if (consumedInput >= io->inputLine.length())
                     {
-                        error("%s: Input \"%s%s\" too short.\n",
-                            name(), 
-                            inputLine.length() > 20 ? "..." : "",
-                            inputLine.expand(-20)());
+                        if (reportMismatch())
+                        {
+                            error("%s: Input \"%s%s\" too short.\n",
+                                name(), 
+                                io->inputLine.length() > 20 ? "..." : "",
+                                io->inputLine.expand(-20)());
 #ifndef NO_TEMPORARY
-                        error("No match for \"%s\"\n",
-                            StreamBuffer(commandIndex-1,i+1).expand()());
+                            error("No match for \"%s\"\n",
+                                StreamBuffer(e->bytes+i, e->length-i).expand()());
 #endif
+                        }
+                        return false;
                     }
-                    return false;
-                }
-                if (command != inputLine[consumedInput])
-                {
-                    if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+                    if (e->bytes[i] != io->inputLine[consumedInput])
                     {
-                        int i = 0;
-                        while (commandIndex[i] >= ' ') i++;
-                        error("%s: Input \"%s%s\" mismatch after %ld byte%s\n",
-                            name(),
-                            consumedInput > 10 ? "..." : "",
-                            inputLine.expand(consumedInput > 10 ?
-                                consumedInput-10 : 0,20)(),
-                            consumedInput,
-                            consumedInput==1 ? "" : "s");
+                        if (reportMismatch())
+                        {
+                            error("%s: Input \"%s%s\" mismatch after %ld byte%s\n",
+                                name(),
+                                consumedInput > 10 ? "..." : "",
+                                io->inputLine.expand(consumedInput > 10 ?
+                                    consumedInput-10 : 0,20)(),
+                                consumedInput,
+                                consumedInput==1 ? "" : "s");
 
 #ifndef NO_TEMPORARY
-                        error("%s: got \"%s\" where \"%s\" was expected\n",
-                            name(),
-                            inputLine.expand(consumedInput, 20)(),
-                            StreamBuffer(commandIndex-1,i+1).expand()());
+                            error("%s: got \"%s\" where \"%s\" was expected\n",
+                                name(),
+                                io->inputLine.expand(consumedInput, 20)(),
+                                StreamBuffer(e->bytes+i, e->length-i).expand()());
 #endif
+                        }
+                        return false;
                     }
-                    return false;
                 }
-                consumedInput++;
+                break;
+            default:
+                break;
         }
     }
-    long surplus = inputLine.length()-consumedInput;
+    long surplus = io->inputLine.length()-consumedInput;
     if (surplus > 0 && !(flags & IgnoreExtraInput))
     {
-        if (!(flags & AsyncMode) && onMismatch[0] != in_cmd)
+        if (reportMismatch())
         {
             error("%s: %ld byte%s surplus input \"%s%s\"\n",
                 name(), surplus, surplus==1 ? "" : "s",
-                inputLine.expand(consumedInput, 20)(),
+                io->inputLine.expand(consumedInput, 20)(),
                 surplus > 20 ? "..." : "");
                 
             if (consumedInput>20)
                 error("%s: after %ld byte%s \"...%s\"\n",
                     name(), consumedInput,
                     consumedInput==1 ? "" : "s",
-                    inputLine.expand(consumedInput-20, 20)());
+                    io->inputLine.expand(consumedInput-20, 20)());
             else
                 error("%s: after %ld byte%s: \"%s\"\n",
                     name(), consumedInput,
                     consumedInput==1 ? "" : "s",
-                    inputLine.expand(0, consumedInput)());
+                    io->inputLine.expand(0, consumedInput)());
         }
         return false;
     }
@@ -1416,7 +2893,7 @@ matchSeparator()
     // called before value is read, first value has Separator flag cleared
     // for second and next value set Separator flag
 
-    if (!separator) {
+    if (!compiled->separator) {
         // empty separator matches
         return true;
     }
@@ -1426,28 +2903,27 @@ matchSeparator()
         flags |= Separator;
         return true;
     }
-    long i;
     long j = consumedInput;
-    for (i = 0; i < separator.length(); i++)
+    for (const Element* e = compiled->inputSeparator;
+        e->type != Element::End; e++)
     {
-        switch (separator[i])
+        switch (e->type)
         {
-            case StreamProtocolParser::skip:
-                j++;
+            case Element::Skip:
+                j += e->length;
                 continue;
-            case StreamProtocolParser::whitespace:
-                while (isspace(inputLine[j])) j++;
+            case Element::Whitespace:
+                while (isspace(io->inputLine[j])) j++;
                 continue;
-            case esc:
-                i++;
             default:
-                if (separator[i] != inputLine[j])
+                if (io->inputLine.length() - j < (long)e->length ||
+                    memcmp(e->bytes, io->inputLine(j), e->length) != 0)
                 {
                     // no match
                     // don't complain here, just return false
                     return false;
                 }
-            j++;
+                j += e->length;
         }
     }
     // separator successfully read
@@ -1466,10 +2942,17 @@ scanValue(const StreamFormat& fmt, long& value)
     }
     flags |= ScanTried;
     if (!matchSeparator()) return -1;
-    long consumed = StreamFormatConverter::find(fmt.conv)->
-        scanLong(fmt, inputLine(consumedInput), value);
+    const Prescanned* p = prescannedValue(fmt);
+    if (p)
+    {
+        value = p->lval;
+        flags |= GotValue;
+        return p->end - p->start;
+    }
+    long consumed = converter(fmt)->
+        scanLong(fmt, io->inputLine(consumedInput), value);
     debug("StreamCore::scanValue(%s, format=%%%c, long) input=\"%s\"\n",
-        name(), fmt.conv, inputLine.expand(consumedInput)());
+        name(), fmt.conv, io->inputLine.expand(consumedInput)());
     if (consumed < 0)
     {
         if (fmt.flags & default_flag)
@@ -1480,7 +2963,7 @@ scanValue(const StreamFormat& fmt, long& value)
         else return -1;
     }
     if (fmt.flags & fix_width_flag && consumed != fmt.width) return -1;
-    if (consumed > inputLine.length()-consumedInput) return -1;
+    if (consumed > io->inputLine.length()-consumedInput) return -1;
     debug("StreamCore::scanValue(%s) scanned %li\n",
         name(), value);
     flags |= GotValue;
@@ -1498,10 +2981,17 @@ scanValue(const StreamFormat& fmt, double& value)
     }
     flags |= ScanTried;
     if (!matchSeparator()) return -1;
-    long consumed = StreamFormatConverter::find(fmt.conv)->
-        scanDouble(fmt, inputLine(consumedInput), value);
+    const Prescanned* p = prescannedValue(fmt);
+    if (p)
+    {
+        value = p->dval;
+        flags |= GotValue;
+        return p->end - p->start;
+    }
+    long consumed = converter(fmt)->
+        scanDouble(fmt, io->inputLine(consumedInput), value);
     debug("StreamCore::scanValue(%s, format=%%%c, double) input=\"%s\"\n",
-        name(), fmt.conv, inputLine.expand(consumedInput, 20)());
+        name(), fmt.conv, io->inputLine.expand(consumedInput, 20)());
     if (consumed < 0)
     {
         if (fmt.flags & default_flag)
@@ -1512,7 +3002,7 @@ scanValue(const StreamFormat& fmt, double& value)
         else return -1;
     }
     if (fmt.flags & fix_width_flag && (consumed != (fmt.width + fmt.prec + 1))) return -1;
-    if (consumed > inputLine.length()-consumedInput) return -1;
+    if (consumed > io->inputLine.length()-consumedInput) return -1;
     debug("StreamCore::scanValue(%s) scanned %#g\n",
         name(), value);
     flags |= GotValue;
@@ -1531,10 +3021,10 @@ scanValue(const StreamFormat& fmt, char* value, long maxlen)
     if (maxlen < 0) maxlen = 0;
     flags |= ScanTried;
     if (!matchSeparator()) return -1;
-    long consumed = StreamFormatConverter::find(fmt.conv)->
-        scanString(fmt, inputLine(consumedInput), value, maxlen);
+    long consumed = converter(fmt)->
+        scanString(fmt, io->inputLine(consumedInput), value, maxlen);
     debug("StreamCore::scanValue(%s, format=%%%c, char*, maxlen=%ld) input=\"%s\"\n",
-        name(), fmt.conv, maxlen, inputLine.expand(consumedInput)());
+        name(), fmt.conv, maxlen, io->inputLine.expand(consumedInput)());
     if (consumed < 0)
     {
         if (fmt.flags & default_flag)
@@ -1545,7 +3035,7 @@ scanValue(const StreamFormat& fmt, char* value, long maxlen)
         else return -1;
     }
     if (fmt.flags & fix_width_flag && consumed != fmt.width) return -1;
-    if (consumed > inputLine.length()-consumedInput) return -1;
+    if (consumed > io->inputLine.length()-consumedInput) return -1;
 #ifndef NO_TEMPORARY
     debug("StreamCore::scanValue(%s) scanned \"%s\"\n",
         name(), StreamBuffer(value, maxlen).expand()());
@@ -1557,10 +3047,10 @@ scanValue(const StreamFormat& fmt, char* value, long maxlen)
 const char* StreamCore::
 getInTerminator(size_t& length)
 {
-    if (inTerminatorDefined)
+    if (compiled->inTerminatorDefined)
     {
-        length = inTerminator.length();
-        return inTerminator();
+        length = compiled->inTerminator.length();
+        return compiled->inTerminator();
     }
     else
     {
@@ -1569,15 +3059,28 @@ getInTerminator(size_t& length)
     }
 }
 
+// Bytes every matching input must start with, if known.
+// Only a fresh message is matched from its start and only without
+// a length limit do message boundaries depend on the terminator.
+const char* StreamCore::
+getInPrefix(size_t& length)
+{
+    length = 0;
+    if (!io || unparsedInput || io->inputBuffer ||
+        compiled->maxInput || activeCommand->command != in_cmd ||
+        activeCommand->elements->type != Element::Literal)
+        return NULL;
+    length = activeCommand->elements->length;
+    return activeCommand->elements->bytes;
+}
+
 // Handle 'event' command
 
 bool StreamCore::
 evalEvent()
 {
-    // code layout:
-    // eventmask timeout
-    unsigned long eventMask = extract<unsigned long>(commandIndex);
-    unsigned long eventTimeout = extract<unsigned long>(commandIndex);
+    unsigned long eventMask = activeCommand->eventMask;
+    unsigned long eventTimeout = activeCommand->timeout;
     if (flags & AsyncMode && eventTimeout == 0)
     {
         if (flags & BusOwner)
@@ -1632,7 +3135,7 @@ eventCallback(StreamIoStatus status)
 bool StreamCore::
 evalWait()
 {
-    unsigned long waitTimeout = extract<unsigned long>(commandIndex);
+    unsigned long waitTimeout = activeCommand->timeout;
     flags |= WaitPending;
     startTimer(waitTimeout);
     return true;
@@ -1658,7 +3161,7 @@ bool StreamCore::
 evalExec()
 {
     formatOutput();
-    debug ("StreamCore::evalExec: command = \"%s\"\n", outputLine.expand()());
+    debug ("StreamCore::evalExec: command = \"%s\"\n", io->outputLine.expand()());
     // release bus
     if (flags & BusOwner)
     {
@@ -1669,7 +3172,7 @@ evalExec()
     }
     if (!execute())
     {
-        error("%s: executing command \"%s\"\n", name(), outputLine());
+        error("%s: executing command \"%s\"\n", name(), io->outputLine());
         return false;
     }
     return true;
@@ -1685,7 +3188,7 @@ execCallback(StreamIoStatus status)
             return;
         default:
             error("%s: Shell command \"%s\" failed\n",
-                name(), outputLine());
+                name(), io->outputLine());
             finishProtocol(Fault);
             return;
     }
@@ -1700,7 +3203,7 @@ bool StreamCore::execute()
 
 bool StreamCore::evalConnect()
 {
-    unsigned long connectTimeout = extract<unsigned long>(commandIndex);
+    unsigned long connectTimeout = activeCommand->timeout;
     if (!busConnectRequest(connectTimeout))
     {
         error("%s: Connect not supported for this bus\n",
@@ -1758,7 +3261,7 @@ void StreamCore::
 printStatus(StreamBuffer& buffer)
 {
     buffer.print("active command=%s ",
-        activeCommand ? commandName(*activeCommand) : "NULL");
+        activeCommand ? commandName(activeCommand->command) : "NULL");
     buffer.print("flags=0x%04lx ", flags);
     if (flags & IgnoreExtraInput) buffer.append("IgnoreExtraInput ");
     if (flags & InitRun) buffer.append("InitRun ");
@@ -1772,6 +3275,7 @@ printStatus(StreamBuffer& buffer)
     if (flags & LockPending) buffer.append("LockPending ");
     if (flags & WritePending) buffer.append("WritePending ");
     if (flags & WaitPending) buffer.append("WaitPending ");
+    if (flags & Running) buffer.append("Running ");
     busPrintStatus(buffer);
 }
 
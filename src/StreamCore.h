@@ -58,6 +58,27 @@ bool matchValue(const StreamFormat& format, const void* fieldaddress)
   matchValue() must return true on success and false on failure.
 
 
+bool compileOnDemand()
+  Called when a protocol is started but has not been compiled because
+  parse() was called with lazy=true. It should call parse() again
+  (without lazy) and return true on success.
+
+void lockCompile()
+void releaseCompile()
+  Protect the shared compiled protocols while references to them are
+  dropped outside of parse() and reload() (which the caller protects).
+  Needed if records run in different threads.
+
+bool cachedReply(const StreamBuffer& query, unsigned long maxAge,
+    StreamBuffer& reply)
+void storeReply(const StreamBuffer& query, const StreamBuffer& reply,
+    unsigned long maxAge)
+  Used with ReplyCache. storeReply() should remember the reply line
+  to query (the bus and the output) together with the current time
+  for maxAge ms. cachedReply() should append a reply to query not
+  older than maxAge ms to reply and return true if there is one.
+  Records of all protocols share the cache.
+
 void protocolStartHook()
 void protocolFinishHook(ProtocolResult)
 void startTimer(unsigned short timeout)
@@ -80,11 +101,13 @@ enum Flags {
     BusOwner = 0x0010,
     Separator = 0x0020,
     ScanTried = 0x0040,
+    Running = 0x0080,
     AcceptInput = 0x0100,
     AcceptEvent = 0x0200,
     LockPending = 0x0400,
     WritePending = 0x0800,
     WaitPending = 0x1000,
+    CollectOutput = 0x4000,
     BusPending = LockPending|WritePending|WaitPending,
     ClearOnStart = InitRun|AsyncMode|GotValue|BusOwner|Separator|ScanTried|
                     AcceptInput|AcceptEvent|BusPending
@@ -124,9 +147,16 @@ protected:
 
     char* streamname;
     unsigned long flags;
+    StreamBuffer busKey;          // bus, address and parameter
 
     bool attachBus(const char* busname, int addr, const char* param);
     void releaseBus();
+    // temporarily talk to a different bus interface (e.g. a recording)
+    StreamBusInterface::Client* busClient() { return this; }
+    StreamBusInterface* replaceBus(StreamBusInterface* bus)
+        { StreamBusInterface* old = businterface;
+          businterface = bus; return old; }
+    bool canRunInitAhead();
 
     bool startProtocol(StartMode);
     void finishProtocol(ProtocolResult);
@@ -140,39 +170,155 @@ protected:
     long scanValue(const StreamFormat& format, char* value, long maxlen);
     long scanValue(const StreamFormat& format);
 
-    StreamBuffer protocolname;
-    unsigned long lockTimeout;
-    unsigned long writeTimeout;
-    unsigned long replyTimeout;
-    unsigned long readTimeout;
-    unsigned long pollPeriod;
-    unsigned long maxInput;
-    bool inTerminatorDefined;
-    bool outTerminatorDefined;
-    StreamBuffer inTerminator;
-    StreamBuffer outTerminator;
-    StreamBuffer separator;
-    StreamBuffer commands;        // the normal protocol
-    StreamBuffer onInit;          // init protocol (optional)
-    StreamBuffer onWriteTimeout;  // error handler (optional)
-    StreamBuffer onReplyTimeout;  // error handler (optional)
-    StreamBuffer onReadTimeout;   // error handler (optional)
-    StreamBuffer onMismatch;      // error handler (optional)
-    const char* commandIndex;     // current position
-    const char* activeCommand;    // start of current command
-    StreamBuffer outputLine;
-    StreamBuffer inputBuffer;
-    StreamBuffer inputLine;
+    // Protocol code decoded for execution (see decode()).
+    // Each in, out and exec string is a sequence of elements,
+    // terminated by an End element. Literal bytes and field addresses
+    // are copied to aligned memory, formats are pre-decoded with their
+    // converters resolved. Running a protocol needs no further decoding.
+    struct Element
+    {
+        enum Type { End, Literal, Skip, Whitespace, Format };
+        Type type;
+        size_t length;                    // Literal, Skip: number of bytes
+        const char* bytes;                // Literal: the bytes
+        StreamFormat format;              // Format: aligned copy
+        StreamFormatConverter* converter; // Format: resolved converter
+        const char* fieldName;            // Format: redirection or NULL
+        const void* fieldAddress;         // Format: redirection or NULL
+        const char* formatString;         // Format: printable for messages
+    };
+
+    struct Instruction
+    {
+        bool (StreamCore::*eval)();
+        unsigned char command;
+        unsigned long timeout;            // wait, event, connect
+        unsigned long eventMask;          // event
+        const Element* elements;          // in, out, exec
+        const char* output;               // constant out: bytes
+        size_t outputSize;                // constant out: number of bytes
+        size_t minInput;                  // in: shortest matching input
+    };
+
+    enum CodeIndex {
+        MainCode, InitCode, WriteTimeoutCode, ReplyTimeoutCode,
+        ReadTimeoutCode, MismatchCode, CodeCount
+    };
+
+    struct Decoder;
+
+    // Everything compile() produces. Records using the same protocol
+    // with the same parameters from the same file share one instance.
+    // It is never modified after compilation.
+    struct Compiled
+    {
+        Compiled* next;
+        StreamBuffer key;             // file, file hash, protocol, params
+        StreamBuffer name;            // protocol and params, '\0' separated
+        unsigned long refcount;
+        bool shareable;               // no record specific field addresses
+        bool events;                  // uses event command
+        bool ignoreExtraInput;
+        unsigned long lockTimeout;
+        unsigned long writeTimeout;
+        unsigned long replyTimeout;
+        unsigned long readTimeout;
+        unsigned long pollPeriod;
+        unsigned long maxInput;
+        unsigned long outputChunk;
+        unsigned long replyCache;
+        bool inTerminatorDefined;
+        bool outTerminatorDefined;
+        StreamBuffer inTerminator;
+        StreamBuffer outTerminator;
+        StreamBuffer separator;
+        StreamBuffer commands;        // the normal protocol
+        StreamBuffer onInit;          // init protocol (optional)
+        StreamBuffer onWriteTimeout;  // error handler (optional)
+        StreamBuffer onReplyTimeout;  // error handler (optional)
+        StreamBuffer onReadTimeout;   // error handler (optional)
+        StreamBuffer onMismatch;      // error handler (optional)
+        char* program;                // memory of decoded code
+        const Instruction* entry[CodeCount]; // decoded protocol and handlers
+        const Element* outputSeparator;
+        const Element* inputSeparator;
+        long codeSize;                // before optimize()
+        long optimizedSize;           // after optimize()
+        size_t decodedSize;           // size of program
+
+        Compiled() : next(NULL), refcount(1), shareable(true), events(false),
+            program(NULL), codeSize(0), optimizedSize(0), decodedSize(0) {}
+        ~Compiled() { delete [] program; }
+        Compiled(const Compiled&); // undefined
+    };
+    static Compiled* sharedProtocols;
+
+    Compiled* compiled;
+    Compiled* building;           // being compiled by load()
+    Compiled* pending;            // reloaded, installed on next start
+    const Instruction* commandIndex;  // next command
+    const Instruction* activeCommand; // current command
+    const Element* activeElement; // current format
+    const char* outputData;       // output of current 'out' command
+    size_t outputSize;
     long consumedInput;
+
+    // Buffers for running protocols, allocated on the first start.
+    // Records which never run do not need them.
+    struct IoBuffers
+    {
+        StreamBuffer outputLine;
+        StreamBuffer inputBuffer;
+        StreamBuffer inputLine;
+        const Element* outputResume;  // where the next output part starts
+        long outputNext;              // offset of its next collected value
+        long outputLimit;             // size of an output part, 0: no limit
+        StreamBuffer collected;       // values collected by printValue()
+        StreamBuffer prescanned;      // values parsed by prescan()
+        const Element* prescanFormat; // array format being prescanned
+        long prescanPos;              // end of last value, -1 if hopeless
+        long prescanNext;             // next value for scanValue()
+        StreamBuffer replyQuery;      // bus and output awaiting a reply
+
+        IoBuffers() : outputResume(NULL), outputNext(0), outputLimit(0),
+            prescanFormat(NULL), prescanPos(0), prescanNext(0) {}
+    };
+    IoBuffers* io;
+
+    // An array value parsed before the whole input line has arrived
+    struct Prescanned
+    {
+        long start;                   // position in input line
+        long end;
+        union { long lval; double dval; };
+    };
     ProtocolResult runningHandler;
-    StreamBuffer fieldAddress;
 
     StreamIoStatus lastInputStatus;
     bool unparsedInput;
 
     StreamCore(const StreamCore&); // undefined
     bool compile(StreamProtocolParser::Protocol*);
+    bool protocolKey(const char* filename, const char* protocolAndParams,
+        StreamBuffer& key);
+    void cacheFile(StreamBuffer& cachefile);
+    bool load(const char* filename, const char* protocolAndParams,
+        bool lazy);
+    void install(Compiled*);
+    void releaseCompiled();
+    static void release(Compiled*&);
+    static bool sameCode(const Compiled*, const Compiled*);
+    bool readCache();
+    void writeCache();
+    void optimize(StreamBuffer& code);
+    size_t decode();
+    void decodeCode(const char* code, Decoder&);
+    const char* decodeString(const char* string, Decoder&, bool output);
+    StreamFormatConverter* converter(const StreamFormat& format)
+        { return activeElement && &format == &activeElement->format ?
+            activeElement->converter : StreamFormatConverter::find(format.conv); }
     bool evalCommand();
+    bool evalEnd();
     bool evalOut();
     bool evalIn();
     bool evalEvent();
@@ -180,8 +326,28 @@ protected:
     bool evalExec();
     bool evalConnect();
     bool evalDisconnect();
-    bool formatOutput();
+    bool formatOutput(unsigned long partSize = 0);
+    bool writeOutputPart();
+    struct FormatPart;
+    static void formatPart(void*);
+    bool formatCollected(const Element*);
+    bool formatCollectedPart(const Element*);
     bool matchInput();
+    long findTerminator(const char* input, long size) const;
+    long matchLine(StreamIoStatus status, long consumed);
+    void prescan();
+    long prescanStart(const StreamBuffer& input);
+    const Element* prescanLiteral();
+    int prescanValues(const StreamBuffer& input, long& pos, long stop,
+        StreamBuffer& values) const;
+    long matchPrescanSeparator(const StreamBuffer& input, long pos,
+        const Element* separator) const;
+    struct ScanPart;
+    static void scanPart(void*);
+    void parallelScan();
+    void resetPrescan();
+    const Prescanned* prescannedValue(const StreamFormat& format);
+    bool reportMismatch();
     bool matchSeparator();
     void printSeparator();
 
@@ -202,8 +368,16 @@ protected:
     void disconnectCallback(StreamIoStatus status);
     const char* getInTerminator(size_t& length);
     const char* getOutTerminator(size_t& length);
+    const char* getInPrefix(size_t& length);
 
 // virtual methods
+    virtual bool compileOnDemand() { return false; }
+    virtual void lockCompile() {}
+    virtual void releaseCompile() {}
+    virtual bool cachedReply(const StreamBuffer&, unsigned long,
+        StreamBuffer&) { return false; }
+    virtual void storeReply(const StreamBuffer&, const StreamBuffer&,
+        unsigned long) {}
     virtual void protocolStartHook() {}
     virtual void protocolFinishHook(ProtocolResult) {}
     virtual void startTimer(unsigned long timeout) = 0;
@@ -216,7 +390,14 @@ protected:
 public:
     StreamCore();
     virtual ~StreamCore();
-    bool parse(const char* filename, const char* protocolname);
+    bool parse(const char* filename, const char* protocolname,
+        bool lazy = false);
+    bool reload(const char* filename, const char* protocolname,
+        bool lazy = false);
+    static const char* cachePath; // directory for compiled protocols or NULL
+    static int scanThreads;       // threads for parsing long array input
+    static int formatThreads;     // threads for formatting long arrays
+    static void (*runParallel)(void (*job)(void*), void* args[], int count);
     void printProtocol();
     const char* name() { return streamname; }
     void printStatus(StreamBuffer& buffer);
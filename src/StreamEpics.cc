@@ -63,6 +63,7 @@ extern DBBASE *pdbbase;
 #include <epicsEvent.h>
 #include <epicsTime.h>
 #include <epicsThread.h>
+#include <epicsStdio.h>
 #include <registryFunction.h>
 #include <iocsh.h>
 
@@ -76,6 +77,7 @@ epicsShareFunc int epicsShareAPI iocshCmd(const char *command);
 #endif
 
 #include <epicsExport.h>
+#include "StreamTimer.h"
 
 #endif
 
@@ -88,7 +90,8 @@ enum MoreFlags {
     // 0x00FFFFFF used by StreamCore
     InDestructor  = 0x0100000,
     ValueReceived = 0x0200000,
-    Aborted       = 0x0400000
+    Aborted       = 0x0400000,
+    Deferred      = 0x0800000  // lazy compilation: compile on first start
 };
 
 extern "C" void streamExecuteCommand(CALLBACK *pcallback);
@@ -114,6 +117,7 @@ class Stream : protected StreamCore
     epicsTimer* timer;
     epicsMutex mutex;
     epicsEvent initDone;
+    static epicsMutex compileMutex;
 #endif
     int status;
     int convert;
@@ -143,6 +147,16 @@ class Stream : protected StreamCore
     void lockMutex();
     void releaseMutex();
     bool execute();
+#ifndef EPICS_3_13
+    bool compileOnDemand();
+    void lockCompile();
+    void releaseCompile();
+    bool replayInit();
+    bool cachedReply(const StreamBuffer& query, unsigned long maxAge,
+        StreamBuffer& reply);
+    void storeReply(const StreamBuffer& query, const StreamBuffer& reply,
+        unsigned long maxAge);
+#endif
     friend void streamExecuteCommand(CALLBACK *pcallback);
     friend void streamRecordProcessCallback(CALLBACK *pcallback);
 
@@ -154,6 +168,7 @@ class Stream : protected StreamCore
         char* busname, int* addr, char* busparam);
     long initRecord(const char* filename, const char* protocol,
         const char* busname, int addr, const char* busparam);
+    long reload();
     bool print(format_t *format, va_list ap);
     bool scan(format_t *format, void* pvalue, size_t maxStringSize);
     bool process();
@@ -178,8 +193,32 @@ public:
 
 // shell functions ///////////////////////////////////////////////////////
 #ifndef EPICS_3_13
+// Set streamLazyCompile to 1 before iocInit to compile protocols
+// only when a record is processed or set to "I/O Intr" the first time.
+int streamLazyCompile = 0;
+// Set streamParallelInit to the number of buses which may run their
+// @init handlers at the same time during iocInit (see runInitAhead()).
+int streamParallelInit = 0;
+// Set streamParallelScan to the number of threads which parse long
+// array input (see StreamCore::parallelScan()).
+int streamParallelScan = 0;
+// Set streamParallelFormat to the number of threads which format long
+// array output (see StreamCore::formatCollected()).
+int streamParallelFormat = 0;
+// Set streamSkipIdleDrain to 1 to skip discarding old input of idle
+// asyn ports before writing (see AsynDriverInterface::writeHandler()).
+int streamSkipIdleDrain = 0;
+// Set streamTimerWheel to a tick length in microseconds to use one
+// timing wheel for all timers instead of timer queues (see StreamTimer.cc).
+int streamTimerWheel = 0;
 extern "C" {
 epicsExportAddress(int, streamDebug);
+epicsExportAddress(int, streamLazyCompile);
+epicsExportAddress(int, streamParallelInit);
+epicsExportAddress(int, streamParallelScan);
+epicsExportAddress(int, streamParallelFormat);
+epicsExportAddress(int, streamSkipIdleDrain);
+epicsExportAddress(int, streamTimerWheel);
 }
 #endif
 
@@ -200,6 +239,12 @@ extern "C" long streamReload(char* recordname)
         return ERROR;
     }
     debug("streamReload(%s)\n", recordname);
+#ifndef EPICS_3_13
+    // read the files again, even if kept for lazy compilation
+    Stream::compileMutex.lock();
+    StreamProtocolParser::free();
+    Stream::compileMutex.unlock();
+#endif
     dbInitEntry(pdbbase,&dbentry);
     for (status = dbFirstRecordType(&dbentry); status == OK;
         status = dbNextRecordType(&dbentry))
@@ -218,9 +263,19 @@ extern "C" long streamReload(char* recordname)
             if (recordname && strcmp(recordname, record->name) != 0)
                 continue;
 
-            // This cancels any running protocol and reloads
-            // the protocol file
-            status = record->dset->init_record(record);
+            Stream* pstream = (Stream*)record->dpvt;
+            if (pstream && pstream->status != ERROR)
+            {
+                // This compiles changed protocols and installs them
+                // when the running protocol has finished
+                status = pstream->reload();
+            }
+            else
+            {
+                // This cancels any running protocol and reloads
+                // the protocol file
+                status = record->dset->init_record(record);
+            }
             if (status == OK || status == DO_NOT_CONVERT)
             {
                 printf("%s: Protocol reloaded\n", record->name);
@@ -232,7 +287,17 @@ extern "C" long streamReload(char* recordname)
         }
     }
     dbFinishEntry(&dbentry);
+#ifdef EPICS_3_13
     StreamProtocolParser::free();
+#else
+    // keep parsed files for lazy compilation
+    if (!streamLazyCompile)
+    {
+        Stream::compileMutex.lock();
+        StreamProtocolParser::free();
+        Stream::compileMutex.unlock();
+    }
+#endif
     return OK;
 }
 
@@ -360,6 +425,10 @@ report(int interest)
     return OK;
 }
 
+#ifndef EPICS_3_13
+static int parseThreads = 1; // see preloadProtocolFiles()
+#endif
+
 long Stream::
 drvInit()
 {
@@ -397,18 +466,935 @@ drvInit()
     }
     debug("StreamProtocolParser::path = %s\n",
         StreamProtocolParser::path);
+    StreamCore::cachePath = getenv("STREAM_PROTOCOL_CACHE");
+    if (StreamCore::cachePath && !*StreamCore::cachePath)
+        StreamCore::cachePath = NULL;
+    debug("StreamCore::cachePath = %s\n",
+        StreamCore::cachePath ? StreamCore::cachePath : "(none)");
+#ifndef EPICS_3_13
+    const char* threads = getenv("STREAM_PARSE_THREADS");
+    if (threads)
+        parseThreads = atoi(threads);
+#if defined(EPICS_VERSION_INT) && EPICS_VERSION_INT >= VERSION_INT(3,15,0,2)
+    else
+        parseThreads = epicsThreadGetCPUs();
+#endif
+    debug("parseThreads = %d\n", parseThreads);
+#endif
     StreamPrintTimestampFunction = streamEpicsPrintTimestamp;
     return OK;
 }
 
+// parallel parsing of protocol files ////////////////////////////////////
+
+#ifndef EPICS_3_13
+// Before the records are initialized, all protocol files referenced by
+// stream records are parsed in worker threads. The records then find
+// the parsed files and only have to compile their protocols.
+// Error messages of each file are collected and printed in the order
+// of the database, so the output does not depend on thread timing.
+
+struct PreloadMessage
+{
+    PreloadMessage* next;
+    char timestamp[40];
+    int line;
+    bool hasFile;
+    StreamBuffer file;
+    StreamBuffer text;
+};
+
+struct PreloadJob
+{
+    PreloadJob* next;
+    StreamBuffer filename;
+    PreloadMessage* messages;
+    PreloadMessage** lastMessage;
+    StreamProtocolParser* parser;
+};
+
+static PreloadJob* preloadJobs;
+static PreloadJob* preloadNext;
+static int preloadRunning;
+static epicsMutexId preloadMutex;
+static epicsEventId preloadDone;
+static epicsThreadPrivateId preloadCurrent;
+
+static bool preloadError(const char* timestamp, int line, const char* file,
+    const char* fmt, va_list args)
+{
+    PreloadJob* job = (PreloadJob*)epicsThreadPrivateGet(preloadCurrent);
+    if (!job) return false;
+    PreloadMessage* message = new PreloadMessage;
+    message->next = NULL;
+    strncpy(message->timestamp, timestamp, sizeof(message->timestamp)-1);
+    message->timestamp[sizeof(message->timestamp)-1] = 0;
+    message->line = line;
+    message->hasFile = file != NULL;
+    message->file = file;
+    message->text.vprint(fmt, args);
+    *job->lastMessage = message;
+    job->lastMessage = &message->next;
+    return true;
+}
+
+static void preloadThread(void*)
+{
+    PreloadJob* job;
+    while (1)
+    {
+        epicsMutexLock(preloadMutex);
+        job = preloadNext;
+        if (job) preloadNext = job->next;
+        epicsMutexUnlock(preloadMutex);
+        if (!job) break;
+        epicsThreadPrivateSet(preloadCurrent, job);
+        job->parser = StreamProtocolParser::parseFile(job->filename());
+        epicsThreadPrivateSet(preloadCurrent, NULL);
+    }
+    epicsMutexLock(preloadMutex);
+    if (--preloadRunning == 0) epicsEventSignal(preloadDone);
+    epicsMutexUnlock(preloadMutex);
+}
+
+static void preloadProtocolFiles()
+{
+    static bool preloaded = false;
+    DBENTRY dbentry;
+    PreloadJob** pjob = &preloadJobs;
+    PreloadJob* job;
+    PreloadMessage* message;
+    char filename[256];
+    long status;
+    int count = 0;
+    int i;
+
+    // streamInit() is called once per record type
+    if (preloaded) return;
+    preloaded = true;
+    if (parseThreads <= 1 || !pdbbase) return;
+    dbInitEntry(pdbbase, &dbentry);
+    for (status = dbFirstRecordType(&dbentry); status == OK;
+        status = dbNextRecordType(&dbentry))
+    {
+        for (status = dbFirstRecord(&dbentry); status == OK;
+            status = dbNextRecord(&dbentry))
+        {
+            char* value;
+            if (dbFindField(&dbentry, "DTYP") != OK)
+                continue;
+            if ((value = dbGetString(&dbentry)) == NULL)
+                continue;
+            if (strcmp(value, "stream") != 0)
+                continue;
+            if (dbFindField(&dbentry, "INP") != OK &&
+                dbFindField(&dbentry, "OUT") != OK)
+                continue;
+            if ((value = dbGetString(&dbentry)) == NULL)
+                continue;
+            if (*value == '@') value++;
+            if (sscanf(value, "%255s", filename) != 1)
+                continue;
+            for (job = preloadJobs; job; job = job->next)
+            {
+                if (strcmp(job->filename(), filename) == 0) break;
+            }
+            if (job) continue;
+            job = new PreloadJob;
+            job->next = NULL;
+            job->filename = filename;
+            job->messages = NULL;
+            job->lastMessage = &job->messages;
+            job->parser = NULL;
+            *pjob = job;
+            pjob = &job->next;
+            count++;
+        }
+    }
+    dbFinishEntry(&dbentry);
+    if (count > 1)
+    {
+        debug("preloadProtocolFiles: parsing %d files in %d threads\n",
+            count, count < parseThreads ? count : parseThreads);
+        preloadNext = preloadJobs;
+        StreamProtocolParser::indexPath();
+        preloadMutex = epicsMutexMustCreate();
+        preloadDone = epicsEventMustCreate(epicsEventEmpty);
+        preloadCurrent = epicsThreadPrivateCreate();
+        StreamErrorHook = preloadError;
+        // this thread is one of the workers
+        preloadRunning = count < parseThreads ? count : parseThreads;
+        for (i = preloadRunning; i > 1; i--)
+        {
+            if (!epicsThreadCreate("streamParse", epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackBig),
+                preloadThread, NULL))
+            {
+                epicsMutexLock(preloadMutex);
+                preloadRunning--;
+                epicsMutexUnlock(preloadMutex);
+            }
+        }
+        preloadThread(NULL);
+        epicsEventMustWait(preloadDone);
+        StreamErrorHook = NULL;
+        epicsThreadPrivateDelete(preloadCurrent);
+        epicsEventDestroy(preloadDone);
+        epicsMutexDestroy(preloadMutex);
+    }
+    while ((job = preloadJobs) != NULL)
+    {
+        preloadJobs = job->next;
+        while ((message = job->messages) != NULL)
+        {
+            job->messages = message->next;
+            StreamPrintError(message->timestamp, message->line,
+                message->hasFile ? message->file() : NULL,
+                "%s", message->text());
+            delete message;
+        }
+        if (job->parser) StreamProtocolParser::addParser(job->parser);
+        delete job;
+    }
+}
+#endif
+
+// running @init handlers ahead //////////////////////////////////////////
+
+#ifndef EPICS_3_13
+// With streamParallelInit > 0, @init handlers that only write constant
+// output, read and wait (see StreamCore::canRunInitAhead()) are run
+// before the records are initialized: records on different buses in
+// parallel (up to streamParallelInit buses at a time), records on the
+// same bus one after the other in database order. A bus is only used
+// up to the first record with any other @init handler, so that the
+// device sees the same sequence of commands as without this option.
+// All I/O is recorded and replayed when iocInit initializes the record,
+// so the record gets its value and alarm state and the same messages as
+// if the handler had run at that time.
+// A recording is only replayed if the record uses the same compiled code
+// and the handler succeeded ahead. Then the record requests the same I/O
+// or stops earlier. Otherwise nothing is replayed and the handler runs
+// again on the bus when the record is initialized, as without this option.
+
+// Messages of the probes are dropped, the records print them when the
+// I/O is replayed. Only a thread while it works for a probe is silenced,
+// all other messages are printed as usual.
+
+static epicsThreadPrivateId initQuiet;
+
+class InitQuiet
+{
+    void* previous;
+public:
+    InitQuiet(void* probe) : previous(epicsThreadPrivateGet(initQuiet))
+        { epicsThreadPrivateSet(initQuiet, probe); }
+    ~InitQuiet()
+        { epicsThreadPrivateSet(initQuiet, previous); }
+};
+
+class InitProbe : protected StreamCore, epicsTimerNotify
+{
+public:
+    enum EventType { LockEvent, WriteEvent, ReadEvent };
+
+    struct Event
+    {
+        Event* next;
+        EventType type;
+        StreamIoStatus status;
+        StreamBuffer data;          // written or read bytes
+    };
+
+    enum Setup { NoInit, RunAhead, RunLater };
+
+    InitProbe* nextProbe;           // all probes in database order
+    InitProbe* nextOnBus;           // probes of the same bus
+    dbCommon* record;
+    Event* events;
+
+    InitProbe(dbCommon* record);
+    ~InitProbe();
+    Setup setup(const char* filename, const char* protocol,
+        const char* busname, int addr, const char* busparam);
+    void run();
+    bool replays(const Compiled* code)
+        { return result == Success && code == compiled; }
+
+private:
+    ProtocolResult result;
+    epicsTimerQueueActive* timerQueue;
+    epicsTimer* timer;
+    epicsMutex mutex;
+    epicsEvent done;
+    Event** lastEvent;
+
+    void addEvent(EventType type, StreamIoStatus status,
+        const void* data = NULL, size_t size = 0);
+
+// epicsTimerNotify method
+    expireStatus expire(const epicsTime&);
+
+// StreamBusInterface::Client methods (recording)
+    void lockCallback(StreamIoStatus status);
+    void writeCallback(StreamIoStatus status);
+    long readCallback(StreamIoStatus status,
+        const void* input, long size);
+
+// StreamCore methods
+    void protocolFinishHook(ProtocolResult);
+    void startTimer(unsigned long timeout);
+    bool getFieldAddress(const char* fieldname,
+        StreamBuffer& address);
+    bool formatValue(const StreamFormat&,
+        const void* fieldaddress);
+    bool matchValue(const StreamFormat&,
+        const void* fieldaddress);
+    void lockMutex();
+    void releaseMutex();
+};
+
+InitProbe::
+InitProbe(dbCommon* _record)
+    : nextProbe(NULL), nextOnBus(NULL), record(_record), events(NULL),
+    result(Abort)
+{
+    streamname = record->name;
+    timerQueue = &epicsTimerQueueActive::allocate(true);
+    timer = &streamCreateTimer(*timerQueue);
+    lastEvent = &events;
+}
+
+InitProbe::
+~InitProbe()
+{
+    InitQuiet quiet(this);
+    Event* event;
+    releaseBus();
+    timer->destroy();
+    timerQueue->release();
+    while ((event = events) != NULL)
+    {
+        events = event->next;
+        delete event;
+    }
+}
+
+InitProbe::Setup InitProbe::
+setup(const char* filename, const char* protocol,
+    const char* busname, int addr, const char* busparam)
+{
+    InitQuiet quiet(this);
+    // the record will not even get to its @init handler
+    if (!attachBus(busname, addr, busparam)) return NoInit;
+    // the probe knows no fields, so the record may still have an @init
+    if (!parse(filename, protocol)) return RunLater;
+    if (!compiled->onInit) return NoInit;
+    // the record must find the same code to replay the recording
+    if (!compiled->key || !compiled->shareable) return RunLater;
+    return canRunInitAhead() ? RunAhead : RunLater;
+}
+
+void InitProbe::
+run()
+{
+    InitQuiet quiet(this);
+    debug("InitProbe::run(%s)\n", name());
+    if (startProtocol(StartInit)) done.wait();
+    releaseBus();
+}
+
+void InitProbe::
+addEvent(EventType type, StreamIoStatus status,
+    const void* data, size_t size)
+{
+    Event* event = new Event;
+    event->next = NULL;
+    event->type = type;
+    event->status = status;
+    if (size) event->data.set(data, size);
+    *lastEvent = event;
+    lastEvent = &event->next;
+}
+
+InitProbe::expireStatus InitProbe::
+expire(const epicsTime&)
+{
+    InitQuiet quiet(this);
+    timerCallback();
+    return noRestart;
+}
+
+// record only what StreamCore accepts
+
+void InitProbe::
+lockCallback(StreamIoStatus status)
+{
+    InitQuiet quiet(this);
+    MutexLock lock(this);
+    if (flags & LockPending) addEvent(LockEvent, status);
+    StreamCore::lockCallback(status);
+}
+
+void InitProbe::
+writeCallback(StreamIoStatus status)
+{
+    InitQuiet quiet(this);
+    MutexLock lock(this);
+    if (flags & WritePending)
+        addEvent(WriteEvent, status, outputData, outputSize);
+    StreamCore::writeCallback(status);
+}
+
+long InitProbe::
+readCallback(StreamIoStatus status, const void* input, long size)
+{
+    InitQuiet quiet(this);
+    MutexLock lock(this);
+    if (flags & AcceptInput) addEvent(ReadEvent, status, input, size);
+    return StreamCore::readCallback(status, input, size);
+}
+
+void InitProbe::
+protocolFinishHook(ProtocolResult _result)
+{
+    result = _result;
+    done.signal();
+}
+
+void InitProbe::
+startTimer(unsigned long timeout)
+{
+    timer->start(*this, timeout * 0.001);
+}
+
+bool InitProbe::
+getFieldAddress(const char*, StreamBuffer&)
+{
+    return false;
+}
+
+bool InitProbe::
+formatValue(const StreamFormat&, const void*)
+{
+    return false;
+}
+
+// Parse one value like a scalar record, but store it nowhere.
+// Whatever the record does with it, the I/O stays the same.
+bool InitProbe::
+matchValue(const StreamFormat& format, const void*)
+{
+    long consumed;
+    long lval;
+    double dval;
+    char sval[256];
+
+    switch (format.type)
+    {
+        case unsigned_format:
+        case signed_format:
+        case enum_format:
+            consumed = scanValue(format, lval);
+            break;
+        case double_format:
+            consumed = scanValue(format, dval);
+            break;
+        case string_format:
+            consumed = scanValue(format, sval, sizeof(sval));
+            break;
+        default:
+            return false;
+    }
+    if (consumed < 0) return false;
+    consumedInput += consumed;
+    return true;
+}
+
+void InitProbe::
+lockMutex()
+{
+    mutex.lock();
+}
+
+void InitProbe::
+releaseMutex()
+{
+    mutex.unlock();
+}
+
+// Plays back the I/O of an InitProbe to a record.
+// All callbacks are called synchronously.
+
+class InitReplay : public StreamBusInterface
+{
+    InitProbe::Event* event;
+
+    bool lockRequest(unsigned long timeout_ms);
+    bool unlock();
+    bool writeRequest(const void* output, size_t size,
+        unsigned long timeout_ms);
+    bool readRequest(unsigned long replytimeout_ms,
+        unsigned long readtimeout_ms, long expectedLength,
+        bool async);
+    void earlyInput();
+    void deviate();
+
+public:
+    bool deviated;
+
+    InitReplay(Client* client, InitProbe::Event* events)
+        : StreamBusInterface(client), event(events), deviated(false) {}
+};
+
+// A deviation should not happen (see Stream::replayInit()). If it does,
+// the request fails with a timeout and the thread is silenced, thus the
+// protocol just ends without messages and the handler runs again.
+
+void InitReplay::
+deviate()
+{
+    deviated = true;
+    epicsThreadPrivateSet(initQuiet, this);
+}
+
+bool InitReplay::
+lockRequest(unsigned long)
+{
+    InitProbe::Event* e = event;
+    if (!e || e->type != InitProbe::LockEvent)
+    {
+        deviate();
+        lockCallback(StreamIoTimeout);
+        return true;
+    }
+    event = e->next;
+    lockCallback(e->status);
+    return true;
+}
+
+bool InitReplay::
+unlock()
+{
+    return true;
+}
+
+void InitReplay::
+earlyInput()
+{
+    InitProbe::Event* e;
+    while ((e = event) != NULL && e->type == InitProbe::ReadEvent)
+    {
+        event = e->next;
+        readCallback(e->status, e->data(), e->data.length());
+    }
+}
+
+bool InitReplay::
+writeRequest(const void* output, size_t size, unsigned long)
+{
+    earlyInput();
+    InitProbe::Event* e = event;
+    if (!e || e->type != InitProbe::WriteEvent ||
+        e->data.length() != (ssize_t)size ||
+        memcmp(e->data(), output, size) != 0)
+    {
+        deviate();
+        writeCallback(StreamIoTimeout);
+        return true;
+    }
+    event = e->next;
+    writeCallback(e->status);
+    return true;
+}
+
+bool InitReplay::
+readRequest(unsigned long, unsigned long, long, bool)
+{
+    InitProbe::Event* e;
+    while ((e = event) != NULL && e->type == InitProbe::ReadEvent)
+    {
+        event = e->next;
+        // the callback may already have requested and replayed more I/O
+        if (readCallback(e->status, e->data(), e->data.length()) == 0)
+            return true;
+    }
+    deviate();
+    readCallback(StreamIoNoReply);
+    return true;
+}
+
+struct InitBus
+{
+    InitBus* next;
+    StreamBuffer name;
+    bool closed;                // a record with another @init came first
+    InitProbe* first;
+    InitProbe** last;
+};
+
+static InitProbe* initProbes;   // not yet replayed, in database order
+static InitBus* initNextBus;
+static int initRunning;
+static epicsMutexId initMutex;
+static epicsEventId initDone;
+
+static bool initIgnoreError(const char*, int, const char*,
+    const char*, va_list)
+{
+    return epicsThreadPrivateGet(initQuiet) != NULL;
+}
+
+static void initThread(void*)
+{
+    InitBus* bus;
+    InitProbe* probe;
+    while (1)
+    {
+        epicsMutexLock(initMutex);
+        bus = initNextBus;
+        if (bus) initNextBus = bus->next;
+        epicsMutexUnlock(initMutex);
+        if (!bus) break;
+        for (probe = bus->first; probe; probe = probe->nextOnBus)
+        {
+            probe->run();
+        }
+    }
+    epicsMutexLock(initMutex);
+    if (--initRunning == 0) epicsEventSignal(initDone);
+    epicsMutexUnlock(initMutex);
+}
+
+static void runInitAhead()
+{
+    DBENTRY dbentry;
+    InitBus* buses = NULL;
+    InitBus** pbus = &buses;
+    InitBus* bus;
+    InitProbe** pprobe = &initProbes;
+    InitProbe* probe;
+    InitProbe::Setup setup;
+    char filename[80];
+    char protocol[80];
+    char busname[80];
+    char busparam[80];
+    int addr;
+    int n;
+    bool array;
+    long status;
+    int count = 0;
+    int i;
+
+    if (streamParallelInit <= 0 || !pdbbase) return;
+    initQuiet = epicsThreadPrivateCreate();
+    StreamErrorHook = initIgnoreError;
+    dbInitEntry(pdbbase, &dbentry);
+    for (status = dbFirstRecordType(&dbentry); status == OK;
+        status = dbNextRecordType(&dbentry))
+    {
+        for (status = dbFirstRecord(&dbentry); status == OK;
+            status = dbNextRecord(&dbentry))
+        {
+            char* value;
+            if (dbFindField(&dbentry, "DTYP") != OK)
+                continue;
+            if ((value = dbGetString(&dbentry)) == NULL)
+                continue;
+            if (strcmp(value, "stream") != 0)
+                continue;
+            if (dbFindField(&dbentry, "INP") != OK &&
+                dbFindField(&dbentry, "OUT") != OK)
+                continue;
+            if ((value = dbGetString(&dbentry)) == NULL)
+                continue;
+            if (*value == '@') value++;
+            addr = -1;
+            if (sscanf(value, "%79s%79s%79s%n%i%n",
+                filename, protocol, busname, &n, &addr, &n) < 3)
+                continue;
+            while (isspace((unsigned char)value[n])) n++;
+            busparam[0] = 0;
+            strncat(busparam, value+n, sizeof(busparam)-1);
+            // arrays read more values than the probe
+            array = dbFindField(&dbentry, "NELM") == OK &&
+                (value = dbGetString(&dbentry)) != NULL && atol(value) > 1;
+
+            for (bus = buses; bus; bus = bus->next)
+            {
+                if (strcmp(bus->name(), busname) == 0) break;
+            }
+            if (!bus)
+            {
+                bus = new InitBus;
+                bus->next = NULL;
+                bus->name = busname;
+                bus->closed = false;
+                bus->first = NULL;
+                bus->last = &bus->first;
+                *pbus = bus;
+                pbus = &bus->next;
+            }
+            if (bus->closed) continue;
+            probe = new InitProbe((dbCommon*)dbentry.precnode->precord);
+            setup = probe->setup(filename, protocol, busname, addr, busparam);
+            if (setup == InitProbe::RunAhead && array)
+                setup = InitProbe::RunLater;
+            if (setup != InitProbe::RunAhead)
+            {
+                if (setup == InitProbe::RunLater)
+                {
+                    debug("runInitAhead: %s stops running ahead on bus %s\n",
+                        probe->record->name, busname);
+                    bus->closed = true;
+                }
+                delete probe;
+                continue;
+            }
+            if (!bus->first) count++;
+            *bus->last = probe;
+            bus->last = &probe->nextOnBus;
+            *pprobe = probe;
+            pprobe = &probe->nextProbe;
+        }
+    }
+    dbFinishEntry(&dbentry);
+    if (count)
+    {
+        debug("runInitAhead: running @init on %d buses in %d threads\n",
+            count, count < streamParallelInit ? count : streamParallelInit);
+        // skip buses without probes
+        for (pbus = &buses; *pbus;)
+        {
+            bus = *pbus;
+            if (bus->first)
+            {
+                pbus = &bus->next;
+                continue;
+            }
+            *pbus = bus->next;
+            delete bus;
+        }
+        initNextBus = buses;
+        initMutex = epicsMutexMustCreate();
+        initDone = epicsEventMustCreate(epicsEventEmpty);
+        // this thread is one of the workers
+        initRunning = count < streamParallelInit ? count : streamParallelInit;
+        for (i = initRunning; i > 1; i--)
+        {
+            if (!epicsThreadCreate("streamInit", epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackBig),
+                initThread, NULL))
+            {
+                epicsMutexLock(initMutex);
+                initRunning--;
+                epicsMutexUnlock(initMutex);
+            }
+        }
+        initThread(NULL);
+        epicsEventMustWait(initDone);
+        epicsEventDestroy(initDone);
+        epicsMutexDestroy(initMutex);
+    }
+    // a replay may still need to be silenced (see InitReplay::deviate())
+    if (!initProbes) StreamErrorHook = NULL;
+    while ((bus = buses) != NULL)
+    {
+        buses = bus->next;
+        delete bus;
+    }
+}
+
+static InitProbe* takeInitProbe(dbCommon* record)
+{
+    InitProbe** pprobe;
+    InitProbe* probe;
+    // records are initialized in database order: usually the first one
+    for (pprobe = &initProbes; *pprobe; pprobe = &(*pprobe)->nextProbe)
+    {
+        probe = *pprobe;
+        if (probe->record == record)
+        {
+            *pprobe = probe->nextProbe;
+            return probe;
+        }
+    }
+    return NULL;
+}
+
+static void dropInitProbes()
+{
+    // records which did not get to their @init handler
+    InitProbe* probe;
+    while ((probe = initProbes) != NULL)
+    {
+        initProbes = probe->nextProbe;
+        delete probe;
+    }
+    if (StreamErrorHook == initIgnoreError) StreamErrorHook = NULL;
+}
+
+// parallel parsing and formatting of long arrays ///////////////////////
+
+// Runs the jobs for StreamCore::parallelScan() and
+// StreamCore::formatCollected() on a pool of worker threads.
+// The calling thread takes the first job and helps with the others
+// of its batch as long as no worker has picked them up.
+
+struct ParallelBatch
+{
+    void (*job)(void*);
+    int left;               // jobs not yet finished
+    epicsEventId done;
+};
+
+struct ParallelJob
+{
+    ParallelJob* next;
+    ParallelBatch* batch;
+    void* arg;
+};
+
+static epicsMutexId parallelLock;
+static epicsEventId parallelWork;
+static ParallelJob* parallelQueue;
+
+// Called with parallelLock held, batch NULL takes any job
+static ParallelJob* takeParallelJob(ParallelBatch* batch)
+{
+    ParallelJob** pj;
+    ParallelJob* job;
+
+    for (pj = &parallelQueue; *pj; pj = &(*pj)->next)
+    {
+        if (!batch || (*pj)->batch == batch)
+        {
+            job = *pj;
+            *pj = job->next;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void finishParallelJob(ParallelBatch* batch)
+{
+    epicsMutexLock(parallelLock);
+    if (--batch->left == 0) epicsEventSignal(batch->done);
+    epicsMutexUnlock(parallelLock);
+}
+
+static void parallelWorker(void*)
+{
+    ParallelJob* job;
+
+    while (1)
+    {
+        epicsEventMustWait(parallelWork);
+        epicsMutexLock(parallelLock);
+        while ((job = takeParallelJob(NULL)) != NULL)
+        {
+            // more work: wake up the next worker
+            if (parallelQueue) epicsEventSignal(parallelWork);
+            epicsMutexUnlock(parallelLock);
+            job->batch->job(job->arg);
+            finishParallelJob(job->batch);
+            epicsMutexLock(parallelLock);
+        }
+        epicsMutexUnlock(parallelLock);
+    }
+}
+
+static void startParallelWorkers(int count)
+{
+    int i;
+
+    parallelLock = epicsMutexMustCreate();
+    parallelWork = epicsEventMustCreate(epicsEventEmpty);
+    for (i = 0; i < count; i++)
+    {
+        if (!epicsThreadCreate("streamParallel", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            parallelWorker, NULL))
+        {
+            // callers do the remaining work themselves
+            error("streamParallel: cannot start worker thread\n");
+            break;
+        }
+    }
+}
+
+static void runParallelJobs(void (*job)(void*), void* args[], int count)
+{
+    ParallelJob* jobs = new ParallelJob[count];
+    ParallelJob* j;
+    ParallelBatch batch;
+    int i;
+    bool wait;
+
+    batch.job = job;
+    batch.left = count;
+    batch.done = epicsEventMustCreate(epicsEventEmpty);
+    epicsMutexLock(parallelLock);
+    for (i = count-1; i > 0; i--)
+    {
+        jobs[i].batch = &batch;
+        jobs[i].arg = args[i];
+        jobs[i].next = parallelQueue;
+        parallelQueue = jobs+i;
+    }
+    epicsMutexUnlock(parallelLock);
+    epicsEventSignal(parallelWork);
+    job(args[0]);
+    finishParallelJob(&batch);
+    epicsMutexLock(parallelLock);
+    while ((j = takeParallelJob(&batch)) != NULL)
+    {
+        epicsMutexUnlock(parallelLock);
+        job(j->arg);
+        finishParallelJob(&batch);
+        epicsMutexLock(parallelLock);
+    }
+    wait = batch.left > 0;
+    epicsMutexUnlock(parallelLock);
+    if (wait) epicsEventMustWait(batch.done);
+    epicsEventDestroy(batch.done);
+    delete [] jobs;
+}
+#endif
+
 // device support (C interface) //////////////////////////////////////////
 
 long streamInit(int after)
 {
     if (after)
     {
+#ifndef EPICS_3_13
+        dropInitProbes();
+        // keep parsed files for lazy compilation
+        if (streamLazyCompile) return OK;
+#endif
         StreamProtocolParser::free();
     }
+#ifndef EPICS_3_13
+    else
+    {
+        // called once for each record type
+        static bool initialized = false;
+        if (initialized) return OK;
+        initialized = true;
+        preloadProtocolFiles();
+        runInitAhead();
+        StreamCore::scanThreads = streamParallelScan;
+        StreamCore::formatThreads = streamParallelFormat;
+        if (streamParallelScan > 1 || streamParallelFormat > 1)
+        {
+            startParallelWorkers((streamParallelScan > streamParallelFormat ?
+                streamParallelScan : streamParallelFormat) - 1);
+            StreamCore::runParallel = runParallelJobs;
+        }
+    }
+#endif
     return OK;
 }
 
@@ -550,7 +1536,7 @@ Stream(dbCommon* _record, const struct link *ioLink,
     callbackSetUser(this, &timeoutCallback);
 #else
     timerQueue = &epicsTimerQueueActive::allocate(true);
-    timer = &timerQueue->createTimer();
+    timer = &streamCreateTimer(*timerQueue);
 #endif
     callbackSetCallback(streamExecuteCommand, &commandCallback);
     callbackSetUser(this, &commandCallback);
@@ -586,6 +1572,197 @@ Stream::
     releaseMutex();
 }
 
+#ifndef EPICS_3_13
+epicsMutex Stream::compileMutex;
+
+// Compile a protocol deferred by initRecord on first use
+// Called by startProtocol with the record mutex locked.
+// The protocol is taken from the link again to save memory.
+bool Stream::
+compileOnDemand()
+{
+    char filename[80];
+    char protocol[80];
+    char busname[80];
+    int addr = -1;
+    char busparam[80];
+
+    if (!(flags & Deferred)) return false;
+    flags &= ~Deferred;
+    if (parseLink(ioLink, filename, protocol,
+        busname, &addr, busparam) != OK) return false;
+    debug("Stream::compileOnDemand(%s): parse(%s, %s)\n",
+        name(), filename, protocol);
+    compileMutex.lock();
+    bool parsed = parse(filename, protocol);
+    compileMutex.unlock();
+    if (!parsed)
+    {
+        error("%s: Protocol parse error\n",
+            name());
+        return false;
+    }
+    return true;
+}
+
+void Stream::
+lockCompile()
+{
+    compileMutex.lock();
+}
+
+void Stream::
+releaseCompile()
+{
+    compileMutex.unlock();
+}
+
+// Replies remembered for ReplyCache, one per bus and output.
+// They are found by a hash of the query. Storing a reply drops the
+// oldest ones when they have expired or when there are too many.
+struct CachedReply
+{
+    CachedReply* next;          // same hash bucket
+    CachedReply* older;
+    CachedReply* newer;
+    StreamBuffer query;
+    StreamBuffer reply;
+    epicsTime time;
+    double maxAge;              // seconds
+};
+static const size_t cachedRepliesBuckets = 256; // power of 2
+static const long cachedRepliesMax = 1024;
+static CachedReply* cachedReplies[cachedRepliesBuckets];
+static CachedReply* oldestReply;
+static CachedReply* newestReply;
+static long cachedRepliesCount;
+static epicsMutex cachedRepliesMutex;
+
+// Returns the link to the entry for query or to where it belongs
+static CachedReply** findReply(const StreamBuffer& query)
+{
+    // 32 bit FNV-1a
+    unsigned long h = 2166136261UL;
+    CachedReply** pc;
+    for (long i = 0; i < query.length(); i++)
+    {
+        h ^= (unsigned char)query[i];
+        h = (h * 16777619UL) & 0xffffffffUL;
+    }
+    for (pc = &cachedReplies[h & (cachedRepliesBuckets-1)]; *pc;
+        pc = &(*pc)->next)
+    {
+        if ((*pc)->query.length() == query.length() &&
+            memcmp((*pc)->query(), query(), query.length()) == 0) break;
+    }
+    return pc;
+}
+
+static void unlinkReply(CachedReply* c)
+{
+    if (c->older) c->older->newer = c->newer;
+    else oldestReply = c->newer;
+    if (c->newer) c->newer->older = c->older;
+    else newestReply = c->older;
+}
+
+static void dropReply(CachedReply* c)
+{
+    CachedReply** pc = findReply(c->query);
+    *pc = c->next;
+    unlinkReply(c);
+    cachedRepliesCount--;
+    delete c;
+}
+
+bool Stream::
+cachedReply(const StreamBuffer& query, unsigned long maxAge,
+    StreamBuffer& reply)
+{
+    CachedReply* c;
+    bool found = false;
+
+    cachedRepliesMutex.lock();
+    c = *findReply(query);
+    if (c && epicsTime::getCurrent() - c->time <= maxAge * 0.001)
+    {
+        reply.append(c->reply);
+        found = true;
+    }
+    cachedRepliesMutex.unlock();
+    return found;
+}
+
+void Stream::
+storeReply(const StreamBuffer& query, const StreamBuffer& reply,
+    unsigned long maxAge)
+{
+    epicsTime now = epicsTime::getCurrent();
+    CachedReply** pc;
+    CachedReply* c;
+
+    cachedRepliesMutex.lock();
+    pc = findReply(query);
+    c = *pc;
+    if (c) unlinkReply(c);
+    else
+    {
+        c = new CachedReply;
+        c->next = NULL;
+        c->query = query;
+        *pc = c;
+        cachedRepliesCount++;
+    }
+    c->reply = reply;
+    c->time = now;
+    c->maxAge = maxAge * 0.001;
+    c->older = newestReply;
+    c->newer = NULL;
+    if (newestReply) newestReply->newer = c;
+    else oldestReply = c;
+    newestReply = c;
+    while ((c = oldestReply) != NULL &&
+        (cachedRepliesCount > cachedRepliesMax || now - c->time > c->maxAge))
+        dropReply(c);
+    cachedRepliesMutex.unlock();
+}
+
+// Run the @init handler with the I/O recorded by runInitAhead().
+// Returns false if there is no usable recording or if the handler did
+// not request the recorded I/O. Then the handler has to run on the bus.
+bool Stream::
+replayInit()
+{
+    InitProbe* probe = takeInitProbe(record);
+    if (!probe) return false;
+    // Without branches in the code, the record requests the same I/O as
+    // the successful probe, or it stops earlier on a value it rejects.
+    // Else the record must not see any of the recording.
+    if (!probe->replays(compiled))
+    {
+        debug("Stream::replayInit %s: recording not usable\n", name());
+        delete probe;
+        return false;
+    }
+    debug("Stream::replayInit %s\n", name());
+    void* quiet = epicsThreadPrivateGet(initQuiet);
+    InitReplay replay(busClient(), probe->events);
+    StreamBusInterface* bus = replaceBus(&replay);
+    bool started = startProtocol(StartInit);
+    if (started) initDone.wait();
+    replaceBus(bus);
+    epicsThreadPrivateSet(initQuiet, quiet);
+    delete probe;
+    if (!started || replay.deviated)
+    {
+        debug("Stream::replayInit %s: does not match the recording\n",
+            name());
+        return false;
+    }
+    return true;
+}
+#endif
+
 long Stream::
 parseLink(const struct link *ioLink, char* filename,
     char* protocol, char* busname, int* addr, char* busparam)
@@ -639,7 +1816,16 @@ initRecord(const char* filename, const char* protocol,
     // parse protocol file
     debug("Stream::initRecord %s: parse(%s, %s)\n",
         name(), filename, protocol);
+#ifdef EPICS_3_13
     if (!parse(filename, protocol))
+#else
+    compileMutex.lock();
+    bool parsed = parse(filename, protocol, streamLazyCompile != 0);
+    compileMutex.unlock();
+    flags &= ~Deferred;
+    if (parsed && !compiled) flags |= Deferred;
+    if (!parsed)
+#endif
     {
         error("%s: Protocol parse error\n",
             name());
@@ -671,24 +1857,30 @@ initRecord(const char* filename, const char* protocol,
     debug("Stream::initRecord %s: initialize the first time\n",
         name());
 
-    if (!onInit) return DO_NOT_CONVERT; // no @init handler, keep DOL
+    // no @init handler, keep DOL
+    if (!compiled || !compiled->onInit) return DO_NOT_CONVERT;
 
     // initialize the record from hardware
-    if (!startProtocol(StartInit))
+#ifndef EPICS_3_13
+    if (!replayInit())
+#endif
     {
-        error("%s: Can't start init run\n",
+        if (!startProtocol(StartInit))
+        {
+            error("%s: Can't start init run\n",
+                name());
+            return ERROR;
+        }
+        debug("Stream::initRecord %s: waiting for initDone\n",
             name());
-        return ERROR;
-    }
-    debug("Stream::initRecord %s: waiting for initDone\n",
-        name());
 #ifdef EPICS_3_13
-    semTake(initDone, WAIT_FOREVER);
+        semTake(initDone, WAIT_FOREVER);
 #else
-    initDone.wait();
+        initDone.wait();
 #endif
-    debug("Stream::initRecord %s: initDone\n",
-        name());
+        debug("Stream::initRecord %s: initDone\n",
+            name());
+    }
 
     // init run has set status and convert
     if (status != NO_ALARM)
@@ -703,6 +1895,56 @@ initRecord(const char* filename, const char* protocol,
     return convert;
 }
 
+// Reload the protocol for streamReload without stopping the running
+// protocol (see StreamCore::reload()). Only "I/O Intr" records waiting
+// for input with a changed protocol are restarted.
+long Stream::
+reload()
+{
+    char filename[80];
+    char protocol[80];
+    char busname[80];
+    int addr = -1;
+    char busparam[80];
+    memset(busparam, 0 ,sizeof(busparam));
+
+    long status = parseLink(ioLink, filename, protocol,
+        busname, &addr, busparam);
+    if (status != OK) return status;
+    debug("Stream::reload %s: reload(%s, %s)\n",
+        name(), filename, protocol);
+    // record mutex before compile lock, as in startProtocol()
+    MutexLock lock(this);
+#ifdef EPICS_3_13
+    bool loaded = StreamCore::reload(filename, protocol);
+#else
+    compileMutex.lock();
+    bool loaded = StreamCore::reload(filename, protocol,
+        streamLazyCompile && !compiled);
+    compileMutex.unlock();
+#endif
+    if (!loaded)
+    {
+        error("%s: Protocol parse error\n",
+            name());
+        return S_dev_noDevice;
+    }
+    if (pending && record->scan == SCAN_IO_EVENT &&
+        !(compiled && sameCode(pending, compiled)))
+    {
+        debug("Stream::reload %s: "
+            "restarting \"I/O Intr\" with new protocol\n",
+            name());
+        finishProtocol(Abort);
+        if (!startProtocol(StartAsync))
+        {
+            error("%s: Can't restart \"I/O Intr\" protocol\n",
+                name());
+        }
+    }
+    return OK;
+}
+
 bool Stream::
 process()
 {
@@ -1353,8 +2595,8 @@ matchValue(const StreamFormat& format, const void* fieldaddress)
         if (currentValueLength > 0)
         {
             error("%s: Record does not accept input \"%s%s\"\n",
-                name(), inputLine.expand(consumedInput, 19)(),
-                inputLine.length()-consumedInput > 20 ? "..." : "");
+                name(), io->inputLine.expand(consumedInput, 19)(),
+                io->inputLine.length()-consumedInput > 20 ? "..." : "");
             flags &= ~ScanTried;
         }
         return false;
@@ -1372,7 +2614,7 @@ void streamExecuteCommand(CALLBACK *pcallback)
 {
     Stream* pstream = static_cast<Stream*>(pcallback->user);
 
-    if (execute(pstream->outputLine()) != OK)
+    if (execute(pstream->io->outputLine()) != OK)
     {
         pstream->execCallback(StreamIoFault);
     }
@@ -1387,7 +2629,7 @@ void streamExecuteCommand(CALLBACK *pcallback)
 {
     Stream* pstream = static_cast<Stream*>(pcallback->user);
 
-    if (iocshCmd(pstream->outputLine()) != OK)
+    if (iocshCmd(pstream->io->outputLine()) != OK)
     {
         pstream->execCallback(StreamIoFault);
     }
@@ -55,6 +55,12 @@ static void printTimestamp(char* buffer, int size)
 
 void (*StreamPrintTimestampFunction)(char* buffer, int size) = printTimestamp;
 
+bool (*StreamErrorHook)(const char* timestamp, int line,
+    const char* file, const char* fmt, va_list args) = NULL;
+
+static void printError(const char* timestamp, int line, const char* file,
+    const char* fmt, va_list args);
+
 void StreamError(const char* fmt, ...)
 {
     va_list args;
@@ -75,6 +81,23 @@ void StreamVError(int line, const char* file, const char* fmt, va_list args)
 {
     char timestamp[40];
     StreamPrintTimestampFunction(timestamp, 40);
+    if (StreamErrorHook && StreamErrorHook(timestamp, line, file, fmt, args))
+        return;
+    printError(timestamp, line, file, fmt, args);
+}
+
+void StreamPrintError(const char* timestamp, int line, const char* file,
+    const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    printError(timestamp, line, file, fmt, args);
+    va_end(args);
+}
+
+static void printError(const char* timestamp, int line, const char* file,
+    const char* fmt, va_list args)
+{
 #ifdef va_copy
     if (StreamDebugFile)
     {
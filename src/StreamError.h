@@ -30,6 +30,19 @@
 extern int streamDebug;
 extern void (*StreamPrintTimestampFunction)(char* buffer, int size);
 
+/* If set, StreamErrorHook is called for every error message before it is
+   printed. It returns true if it has taken the message (e.g. to print it
+   later with StreamPrintError) and false if the message should be printed
+   as usual. It must not touch args in the latter case.
+*/
+extern bool (*StreamErrorHook)(const char* timestamp, int line,
+    const char* file, const char* fmt, va_list args);
+
+/* Prints a message taken by StreamErrorHook as it would have been */
+void StreamPrintError(const char* timestamp, int line, const char* file,
+    const char* fmt, ...)
+__attribute__ ((format(printf,4,5)));
+
 void StreamError(int line, const char* file, const char* fmt, ...)
 __attribute__ ((format(printf,3,4)));
 
@@ -237,6 +237,12 @@ scanPseudo(const StreamFormat& fmt, StreamBuffer&, long&)
     return -1;
 }
 
+bool StreamFormatConverter::
+cacheable(const StreamFormat&)
+{
+    return true;
+}
+
 static void copyFormatString(StreamBuffer& info, const char* source)
 {
     const char* p = source - 1;
@@ -255,7 +261,10 @@ static void copyFormatString(StreamBuffer& info, const char* source)
 
 // Standard Long Converter for 'diouxX'
 
-static int prepareval(const StreamFormat& fmt, const char*& input, bool& neg)
+// fmt is shared between records and threads: copy limited input
+// to the caller's buffer, not to fmt.info.
+static int prepareval(const StreamFormat& fmt, const char*& input, bool& neg,
+    StreamBuffer& copy)
 {
     int length = 0;
     neg = false;
@@ -264,15 +273,16 @@ static int prepareval(const StreamFormat& fmt, const char*& input, bool& neg)
     {
         // take local copy because strto* don't have width parameter
         int width = fmt.width;
+        int n = 0;
         if (fmt.flags & space_flag)
         {
             // normally whitespace does not count to width
             // but do so if space flag is present
             width -= length;
         }
-        strncpy((char*)fmt.info, input, width);
-        ((char*)fmt.info)[width] = 0;
-        input = fmt.info;
+        while (n < width && input[n]) n++;
+        copy.set(input, n);
+        input = copy();
     }
     if (*input == '+')
     {
@@ -310,11 +320,7 @@ parse(const StreamFormat& fmt, StreamBuffer& info,
             fmt.prec, fmt.conv);
         return false;
     }
-    if (scanFormat)
-    {
-        if (fmt.width) info.reserve(fmt.width+1);
-    }
-    else
+    if (!scanFormat)
     {
         copyFormatString(info, source);
         info.append('l');
@@ -342,8 +348,9 @@ scanLong(const StreamFormat& fmt, const char* input, long& value)
     bool neg;
     int base;
     long v;
+    StreamBuffer copy;
 
-    length = prepareval(fmt, input, neg);
+    length = prepareval(fmt, input, neg, copy);
     if (length < 0) return -1;
     switch (fmt.conv)
     {
@@ -392,11 +399,7 @@ parse(const StreamFormat& fmt, StreamBuffer& info,
             fmt.prec, fmt.conv);
         return false;
     }
-    if (scanFormat)
-    {
-        if (fmt.width) info.reserve(fmt.width+1);
-    }
-    else
+    if (!scanFormat)
     {
         copyFormatString(info, source);
         info.append(fmt.conv);
@@ -417,8 +420,9 @@ scanDouble(const StreamFormat& fmt, const char* input, double& value)
     char* end;
     int length;
     bool neg;
+    StreamBuffer copy;
 
-    length = prepareval(fmt, input, neg);
+    length = prepareval(fmt, input, neg, copy);
     if (length < 0) return -1;
     value = strtod(input, &end);
     if (neg) value = -value;
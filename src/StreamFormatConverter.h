@@ -64,6 +64,7 @@ public:
         const char* input, char* value, size_t maxlen);
     virtual int scanPseudo(const StreamFormat& fmt,
         StreamBuffer& inputLine, long& cursor);
+    virtual bool cacheable(const StreamFormat& fmt);
 };
 
 inline StreamFormatConverter* StreamFormatConverter::
@@ -143,6 +144,13 @@ void* ref_##converter = &registrar_##converter\
 * skip_flag is set, you don't need to write to value, since the value will be
 * discarded anyway. Return -1 on failure.
 *
+* cacheable()
+* ===========
+* Compiled protocols may be stored in a cache file and loaded by another
+* IOC process (see STREAM_PROTOCOL_CACHE). If info contains pointers or
+* anything else which is only valid in the current process, return false.
+* The default implementation returns true.
+*
 *
 * Register your class
 * ===================
@@ -21,6 +21,11 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#if !defined(windows) && !defined(_WIN32)
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
 #include "StreamProtocol.h"
 #include "StreamFormatConverter.h"
 #include "StreamError.h"
@@ -46,11 +51,135 @@ class StreamProtocolParser::Protocol::Variable
     ~Variable();
 };
 
+//////////////////////////////////////////////////////////////////////////////
+// StreamProtocolParser::NameIndex
+// Hash table to find parsers, protocols and variables by name.
+// Names are not copied and must exist as long as the index.
+
+class StreamProtocolParser::NameIndex
+{
+    struct Entry
+    {
+        Entry* next;
+        const char* name;
+        void* object;
+    };
+    Entry** buckets;
+    size_t size;
+    size_t count;
+
+    static size_t hash(const char* name);
+public:
+    NameIndex() : buckets(NULL), size(0), count(0) {}
+    ~NameIndex() { clear(); }
+    void* find(const char* name) const;
+    void insert(const char* name, void* object);
+    void clear();
+};
+
+size_t StreamProtocolParser::NameIndex::
+hash(const char* name)
+{
+    // 32 bit FNV-1a
+    unsigned long h = 2166136261UL;
+    while (*name)
+    {
+        h ^= (unsigned char)*name++;
+        h = (h * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
+}
+
+void* StreamProtocolParser::NameIndex::
+find(const char* name) const
+{
+    if (!count) return NULL;
+    Entry* e;
+    for (e = buckets[hash(name) & (size-1)]; e; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0) return e->object;
+    }
+    return NULL;
+}
+
+void StreamProtocolParser::NameIndex::
+insert(const char* name, void* object)
+{
+    Entry* e;
+    size_t i;
+    if (count >= size)
+    {
+        // grow to keep chains short
+        size_t newsize = size ? 2*size : 16;
+        Entry** newbuckets = new Entry*[newsize];
+        memset(newbuckets, 0, newsize * sizeof(Entry*));
+        for (i = 0; i < size; i++)
+        {
+            while ((e = buckets[i]) != NULL)
+            {
+                buckets[i] = e->next;
+                size_t j = hash(e->name) & (newsize-1);
+                e->next = newbuckets[j];
+                newbuckets[j] = e;
+            }
+        }
+        delete [] buckets;
+        buckets = newbuckets;
+        size = newsize;
+    }
+    i = hash(name) & (size-1);
+    e = new Entry;
+    e->name = name;
+    e->object = object;
+    e->next = buckets[i];
+    buckets[i] = e;
+    count++;
+}
+
+void StreamProtocolParser::NameIndex::
+clear()
+{
+    Entry* e;
+    for (size_t i = 0; i < size; i++)
+    {
+        while ((e = buckets[i]) != NULL)
+        {
+            buckets[i] = e->next;
+            delete e;
+        }
+    }
+    delete [] buckets;
+    buckets = NULL;
+    size = 0;
+    count = 0;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // StreamProtocolParser
 
 StreamProtocolParser* StreamProtocolParser::parsers = NULL;
+static StreamProtocolParser::NameIndex parserIndex;
 const char* StreamProtocolParser::path = ".";
+
+struct StreamProtocolParser::FileHash
+{
+    FileHash* next;
+    StreamBuffer filename;
+    StreamBuffer hash;
+};
+StreamProtocolParser::FileHash* StreamProtocolParser::fileHashes = NULL;
+
+struct StreamProtocolParser::PathEntry
+{
+    PathEntry* next;
+    StreamBuffer fullname;        // dir and file name, the index key
+    bool isDir;                   // entry for a dir of the search path
+    time_t mtime;                 // isDir: modification time when listed
+    time_t indexed;               // isDir: time when listed, 0 if not
+};
+StreamProtocolParser::PathEntry* StreamProtocolParser::pathEntries = NULL;
+static StreamProtocolParser::NameIndex pathIndex;
+static StreamBuffer indexedPath;
 static const char* specialChars = " ,;{}=()$'\"+-*/";
 
 // Client destructor
@@ -61,17 +190,23 @@ StreamProtocolParser::Client::
 
 // Private constructor
 StreamProtocolParser::
-StreamProtocolParser(FILE* file, const char* filename)
-    : filename(filename), file(file), globalSettings(filename)
+StreamProtocolParser(const char* contents, size_t size, const char* filename)
+    : filename(filename), globalSettings(filename)
 {
+    input = contents;
+    inputEnd = contents + size;
+    ungotten = EOF;
 
-    next = parsers;
-    parsers = this;
+    next = NULL;
     // start parsing in global context
     protocols = NULL;
+    lastProtocol = &protocols;
+    protocolIndex = new NameIndex;
     line = 1;
     quote = false;
     valid = parseProtocol(globalSettings, globalSettings.commands);
+    // contents belong to the caller
+    input = inputEnd = NULL;
 }
 
 // Private destructor
@@ -79,6 +214,7 @@ StreamProtocolParser::
 ~StreamProtocolParser()
 {
     delete protocols;
+    delete protocolIndex;
     delete next;
 }
 
@@ -105,18 +241,12 @@ getProtocol(const char* filename, const StreamBuffer& protocolAndParams)
     StreamProtocolParser* parser;
 
     // Have we already seen this file?
-    for (parser = parsers; parser; parser = parser->next)
+    parser = (StreamProtocolParser*)parserIndex.find(filename);
+    if (parser && !parser->valid)
     {
-        if (parser->filename.startswith(filename))
-        {
-            if (!parser->valid)
-            {
-                error("Protocol file '%s' is invalid (see above)\n",
-                    filename);
-                return NULL;
-            }
-            break;
-        }
+        error("Protocol file '%s' is invalid (see above)\n",
+            filename);
+        return NULL;
     }
     if (!parser)
     {
@@ -136,8 +266,71 @@ getProtocol(const char* filename, const StreamBuffer& protocolAndParams)
 void StreamProtocolParser::
 free()
 {
+    parserIndex.clear();
     delete parsers;
     parsers = NULL;
+    while (fileHashes)
+    {
+        FileHash* h = fileHashes;
+        fileHashes = h->next;
+        delete h;
+    }
+    pathIndex.clear();
+    indexedPath.clear();
+    while (pathEntries)
+    {
+        PathEntry* e = pathEntries;
+        pathEntries = e->next;
+        delete e;
+    }
+}
+
+// API function: get a hash of the contents of a protocol file
+// (e.g. to identify compiled protocols in a cache)
+// RETURNS: false if file cannot be read
+// SIDEEFFECTS: file IO (once per file until free() is called)
+bool StreamProtocolParser::
+getFileHash(const char* filename, StreamBuffer& hash)
+{
+    FileHash* h;
+    for (h = fileHashes; h; h = h->next)
+    {
+        if (strcmp(h->filename(), filename) == 0)
+        {
+            hash = h->hash;
+            return true;
+        }
+    }
+    FILE* file = openFile(filename);
+    if (!file) return false;
+
+    // 64 bit FNV-1a hash of the contents
+    unsigned long long fnv = 14695981039346656037ULL;
+    unsigned long long size = 0;
+    unsigned char chunk[4096];
+    size_t i, n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            fnv ^= chunk[i];
+            fnv *= 1099511628211ULL;
+        }
+        size += n;
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    if (!ok) return false;
+
+    h = new FileHash;
+    h->filename = filename;
+    h->hash.print("%08lx%08lx-%lu",
+        (unsigned long)(fnv >> 32), (unsigned long)(fnv & 0xffffffff),
+        (unsigned long)size);
+    h->next = fileHashes;
+    fileHashes = h;
+    hash = h->hash;
+    return true;
 }
 
 /*
@@ -151,55 +344,179 @@ No coding of parameters, commands, functions, or formats yet. We'll do
 this after protocol arguments have been replaced.
 */
 
-StreamProtocolParser* StreamProtocolParser::
-readFile(const char* filename)
-{
-    FILE* file;
 #ifdef windows
-    const char pathseparator = ';';
-    const char dirseparator = '\\';
+static const char pathseparator = ';';
+static const char dirseparator = '\\';
 #else
-    const char pathseparator = ':';
-    const char dirseparator = '/';
+static const char pathseparator = ':';
+static const char dirseparator = '/';
 #endif
-    StreamProtocolParser* parser;
+
+// get next dir from search path (avoiding strtok, strsep, strcspn)
+// RETURNS: start of the following dir
+static const char* nextDir(const char* p, StreamBuffer& dir)
+{
+    const char* s = strchr(p, pathseparator);
+    size_t n = s ? s - p : strlen(p);
+    dir.clear();
+    dir.append(p, n);
+    if (n && p[n-1] != dirseparator) dir.append(dirseparator);
+    return s ? s + 1 : p + n;
+}
+
+// API function: list all dirs in search path once, so that finding a
+// file does not need to try every dir. Called by openFile() on demand.
+// Call it before opening files in parallel threads, it is not thread
+// safe.
+void StreamProtocolParser::
+indexPath()
+{
+    if (indexedPath && strcmp(indexedPath(), path) == 0) return;
+    pathIndex.clear();
+    while (pathEntries)
+    {
+        PathEntry* e = pathEntries;
+        pathEntries = e->next;
+        delete e;
+    }
+    indexedPath = path;
+    const char* p;
+    StreamBuffer dir;
+    PathEntry** last = &pathEntries;
+    for (p = path; *p; )
+    {
+        p = nextDir(p, dir);
+        // one entry per dir, in search path order
+        PathEntry* d = new PathEntry;
+        d->fullname = dir;
+        d->isDir = true;
+        d->mtime = 0;
+        d->indexed = 0;
+        d->next = *last;
+        *last = d;
+        last = &d->next;
+#if !defined(windows) && !defined(_WIN32)
+        struct stat st;
+        if (stat(dir ? dir() : ".", &st) != 0) continue;
+        DIR* dp = opendir(dir ? dir() : ".");
+        if (!dp) continue;
+        d->mtime = st.st_mtime;
+        d->indexed = time(NULL);
+        struct dirent* entry;
+        StreamBuffer fullname;
+        while ((entry = readdir(dp)) != NULL)
+        {
+            fullname = dir;
+            fullname.append(entry->d_name);
+            // only regular files (or links to them) can be protocol files
+            if (stat(fullname(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            PathEntry* e = new PathEntry;
+            e->fullname = fullname;
+            e->isDir = false;
+            e->next = *last;
+            *last = e;
+            last = &e->next;
+            pathIndex.insert(e->fullname(), e);
+        }
+        closedir(dp);
+        debug("StreamProtocolParser::indexPath: indexed '%s'\n", dir());
+#endif
+    }
+}
+
+// Find file in search path and open it for reading
+FILE* StreamProtocolParser::
+openFile(const char* filename)
+{
+    FILE* file;
     const char *p;
-    const char *s;
-    size_t n;
     StreamBuffer dir;
 
-    // look for filename in every dir in search path
-    for (p = path; *p; p += n)
+    indexPath();
+    // pathEntries lists each dir followed by its files
+    PathEntry* d = pathEntries;
+    bool plainName = strchr(filename, dirseparator) == NULL;
+    for (p = path; *p; )
     {
-        dir.clear();
-        // get next dir from search path (avoiding strtok, strsep, strcspn)
-        s = strchr(p, pathseparator);
-        if (s) n = s - p;
-        else n = strlen(p);
-        dir.append(p, n);
-        if (n && p[n-1] != dirseparator) dir.append(dirseparator);
-        if (s) p++;
+        p = nextDir(p, dir);
+        // The index of a dir is only good if the dir has not changed since
+        // (a file added later must still take precedence over later dirs).
+        // Modifications in the second of listing cannot be told apart.
+        bool known = false;
+#if !defined(windows) && !defined(_WIN32)
+        struct stat st;
+        known = plainName && d && d->isDir && d->indexed &&
+            d->mtime < d->indexed &&
+            stat(dir ? dir() : ".", &st) == 0 && st.st_mtime == d->mtime;
+#endif
+        if (d && d->isDir) d = d->next;
+        while (d && !d->isDir) d = d->next;
         // append filename
         dir.append(filename);
+        if (known && !pathIndex.find(dir())) continue;
         // try to read the file
-        debug("StreamProtocolParser::readFile: try '%s'\n", dir());
+        debug("StreamProtocolParser::openFile: try '%s'\n", dir());
         file = fopen(dir(), "r");
-        if (file)
-        {
-            // file found; create a parser to read it
-            parser = new StreamProtocolParser(file, filename);
-            fclose(file);
-            if (!parser->valid) return NULL;
-//             printf(
+        if (file) return file;
+    }
+    return NULL;
+}
+
+StreamProtocolParser* StreamProtocolParser::
+readFile(const char* filename)
+{
+    StreamProtocolParser* parser = parseFile(filename);
+    if (!parser)
+    {
+        error("Can't find readable file '%s' in '%s'\n", filename, path);
+        return NULL;
+    }
+    addParser(parser);
+    if (!parser->valid) return NULL;
+//         printf(
 // "/---------------------------------------------------------------------\\\n");
-//             parser->report();
-//             printf(
+//         parser->report();
+//         printf(
 // "\\---------------------------------------------------------------------/\n");
-            return parser;
-        }
+    return parser;
+}
+
+// API function: parse a protocol file without registering the parser
+// Only touches the new parser, thus different files can be parsed in
+// parallel threads. Register the result with addParser() afterwards.
+// RETURNS: a parser (possibly invalid) or NULL if file is not found
+StreamProtocolParser* StreamProtocolParser::
+parseFile(const char* filename)
+{
+    FILE* file = openFile(filename);
+    if (!file) return NULL;
+    // file found; read it completely and create a parser for the contents
+    StreamBuffer contents;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        contents.append(chunk, n);
     }
-    error("Can't find readable file '%s' in '%s'\n", filename, path);
-    return NULL;
+    fclose(file);
+    StreamProtocolParser* parser =
+        new StreamProtocolParser(contents(), contents.length(), filename);
+    return parser;
+}
+
+// API function: make a parser returned by parseFile() known to
+// getProtocol(). Deletes it if that file has already been read.
+void StreamProtocolParser::
+addParser(StreamProtocolParser* parser)
+{
+    if (parserIndex.find(parser->filename()))
+    {
+        delete parser;
+        return;
+    }
+    parser->next = parsers;
+    parsers = parser;
+    parserIndex.insert(parser->filename(), parser);
 }
 
 /*
@@ -220,10 +537,9 @@ getProtocol(const StreamBuffer& protocolAndParams)
     char* p;
     for (p = name(); *p; p++) *p = tolower(*p);
     // find and make a copy with parameters inserted
-    Protocol* protocol;
-    for (protocol = protocols; protocol; protocol = protocol->next)
+    Protocol* protocol = (Protocol*)protocolIndex->find(name());
+    if (protocol)
     {
-        if (protocol->protocolname.startswith(name()))
         // constructor also replaces parameters
         return new Protocol(*protocol, name, 0);
     }
@@ -346,14 +662,10 @@ parseProtocol(Protocol& protocol, StreamBuffer* commands)
                     token());
                 return false;
             }
-            Protocol** ppP;
-            for (ppP = &protocols; *ppP; ppP = &(*ppP)->next)
+            if (protocolIndex->find(token()))
             {
-                if ((*ppP)->protocolname.startswith(token()))
-                {
-                    error(line, filename(), "Protocol '%s' redefined\n", token());
-                    return false;
-                }
+                error(line, filename(), "Protocol '%s' redefined\n", token());
+                return false;
             }
             Protocol* pP = new Protocol(protocol, token, startline);
             if (!parseProtocol(*pP, pP->commands))
@@ -364,7 +676,9 @@ parseProtocol(Protocol& protocol, StreamBuffer* commands)
                 return false;
             }
             // append new protocol to parser
-            *ppP = pP;
+            *lastProtocol = pP;
+            lastProtocol = &pP->next;
+            protocolIndex->insert(pP->protocolname(), pP);
             continue;
         }
         // Must be a command or a protocol reference.
@@ -376,22 +690,18 @@ parseProtocol(Protocol& protocol, StreamBuffer* commands)
         }
         if (op == ';' || op == '}') // no arguments
         {
-            if (op == '}') ungetc(op, file);
+            if (op == '}') ungetChar(op);
             // Check for protocol reference
-            Protocol* p;
-            for (p = protocols; p; p = p->next)
+            Protocol* p = (Protocol*)protocolIndex->find(token());
+            if (p)
             {
-                if (p->protocolname.startswith(token()))
-                {
-                    commands->append(*p->commands);
-                    break;
-                }
+                commands->append(*p->commands);
+                continue;
             }
-            if (p) continue;
         }
         // must be a command (validity will be checked later)
         commands->append(token); // is null separated
-        ungetc(op, file); // put back first char of value
+        ungetChar(op); // put back first char of value
         if (parseValue(*commands, true) == false)
         {
             line = startline;
@@ -407,21 +717,21 @@ int StreamProtocolParser::
 readChar()
 {
     int c;
-    c = getc(file);
+    c = getChar();
     if (isspace(c) || c == '#') // blanks or comments
     {
         do {
             if (c == '#') // comments
             {
-                while ((c = getc(file)) != EOF && c != '\n');
+                while ((c = getChar()) != EOF && c != '\n');
             }
             if (c == '\n')
             {
                 ++line; // count newlines
             }
-            c = getc(file);
+            c = getChar();
         } while (isspace(c) || c == '#');
-        if (c != EOF) ungetc(c, file); // put back non-blank
+        if (c != EOF) input--; // put back non-blank
         c = ' '; // return one space for all spaces and comments
     }
     return c;
@@ -456,7 +766,7 @@ Each time newline is read, line is incremented.
         debug("StreamProtocolParser::readToken: Variable\n");
         buffer.append(c);
         if (quote) buffer.append('"'); // mark as quoted variable
-        c = getc(file);
+        c = getChar();
         if (c >= '0' && c <= '9')
         {
             // positional parameter $0 ... $9
@@ -472,7 +782,7 @@ Each time newline is read, line is incremented.
             if (!readToken(buffer, "{}=;")) return false;
             debug("StreamProtocolParser::readToken: Variable '%s' in {}\n",
                 buffer(token));
-            c = getc(file);
+            c = getChar();
             if (c != '}')
             {
                 error(line, filename(), "Expect '}' instead of '%c' after: %s\n",
@@ -501,7 +811,7 @@ Each time newline is read, line is incremented.
         if (!quote)
         {
             quote = c;
-            c = getc(file);
+            c = getChar();
         }
         buffer.append(quote);
         while (quote)
@@ -517,7 +827,7 @@ Each time newline is read, line is incremented.
                 // quoted variable reference
                 // terminate string here and do variable in next pass
                 buffer[-1] = quote;
-                ungetc(c, file);
+                ungetChar(c);
                 break;
             }
             buffer.append(c);
@@ -526,7 +836,7 @@ Each time newline is read, line is incremented.
                 quote = false;
                 break;
             }
-            c = getc(file);
+            c = getChar();
         }
         buffer.append('\0').append(&l, sizeof(l)); // append line number
         return true;
@@ -557,7 +867,7 @@ Each time newline is read, line is incremented.
         if ((c = readChar()) == EOF) break;
         if (strchr (specialchars, c))
         {
-            ungetc(c, file); // put back char of next token
+            ungetChar(c); // put back char of next token
             break;
         }
     }
@@ -584,7 +894,7 @@ parseValue(StreamBuffer& buffer, bool lazy)
     int c;
 
     do c = readChar(); while (c == ' '); // skip leading spaces
-    ungetc (c, file);
+    ungetChar(c);
     while (true)
     {
         token = buffer.length(); // start of next token
@@ -618,7 +928,7 @@ parseValue(StreamBuffer& buffer, bool lazy)
             if (c != ';')
             {
                 // let's be generous with missing ';' before '}'
-                ungetc (c, file);
+                ungetChar(c);
             }
             return true;
         }
@@ -717,6 +1027,8 @@ Protocol(const char* filename)
     line = 0;
     next = NULL;
     variables = new Variable(NULL, 0, 500);
+    lastVariable = &variables->next;
+    variableIndex = new NameIndex;
     commands = &variables->value;
 }
 
@@ -728,13 +1040,16 @@ Protocol(const Protocol& p, StreamBuffer& name, int _line)
     next = NULL;
     // copy all variables
     Variable* pV;
-    Variable** ppNewV = &variables;
+    lastVariable = &variables;
+    variableIndex = new NameIndex;
     line = _line ? _line : p.line;
     debug("new Protocol(name=\"%s\", line=%d)\n", name(), line);
     for (pV = p.variables; pV; pV = pV->next)
     {
-        *ppNewV = new Variable(*pV);
-        ppNewV = &(*ppNewV)->next;
+        *lastVariable = new Variable(*pV);
+        if (pV->name) variableIndex->insert((*lastVariable)->name(),
+            *lastVariable);
+        lastVariable = &(*lastVariable)->next;
     }
     commands = &variables->value;
     if (line) variables->line = line;
@@ -756,6 +1071,7 @@ Protocol(const Protocol& p, StreamBuffer& name, int _line)
 StreamProtocolParser::Protocol::
 ~Protocol()
 {
+    delete variableIndex;
     delete variables;
     delete next;
 }
@@ -788,17 +1104,17 @@ report()
 StreamBuffer* StreamProtocolParser::Protocol::
 createVariable(const char* name, int linenr)
 {
-    Variable** ppV;
-    for (ppV = &variables; *ppV; ppV = &(*ppV)->next)
+    Variable* pV = (Variable*)variableIndex->find(name);
+    if (pV)
     {
-        if ((*ppV)->name.startswith(name))
-        {
-            (*ppV)->line = linenr;
-            return &(*ppV)->value;
-        }
+        pV->line = linenr;
+        return &pV->value;
     }
-    *ppV = new Variable(name, linenr);
-    return &(*ppV)->value;
+    pV = new Variable(name, linenr);
+    *lastVariable = pV;
+    lastVariable = &pV->next;
+    variableIndex->insert(pV->name(), pV);
+    return &pV->value;
 }
 
 const StreamProtocolParser::Protocol::Variable*
@@ -807,15 +1123,11 @@ getVariable(const char* name)
 {
     Variable* pV;
 
-    for (pV = variables; pV; pV = pV->next)
-    {
-        if (pV->name.startswith(name))
-        {
-            pV->used = true;
-            return pV;
-        }
-    }
-    return NULL;
+    // the first (unnamed) variable holds the commands
+    if (!name || !*name) pV = variables;
+    else pV = (Variable*)variableIndex->find(name);
+    if (pV) pV->used = true;
+    return pV;
 }
 
 bool StreamProtocolParser::Protocol::
@@ -1516,6 +1828,14 @@ compileCommands(StreamBuffer& buffer, const char*& source, Client* client)
     return true;
 }
 
+// Check for a non-empty handler without compiling it
+bool StreamProtocolParser::Protocol::
+hasHandler(const char* handlername)
+{
+    const Variable* pvar = getVariable(handlername);
+    return pvar && pvar->value;
+}
+
 bool StreamProtocolParser::Protocol::
 checkUnused()
 {
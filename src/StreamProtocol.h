@@ -36,6 +36,7 @@ public:
     };
 
     class Client;
+    class NameIndex;
 
     class Protocol
     {
@@ -46,6 +47,8 @@ public:
     private:
         Protocol* next;
         Variable* variables;
+        Variable** lastVariable;
+        NameIndex* variableIndex;
         const StreamBuffer protocolname;
         StreamBuffer* commands;
         int line;
@@ -75,6 +78,7 @@ public:
         bool compileString(StreamBuffer& buffer, const char*& source,
             FormatType formatType = NoFormat, Client* = NULL, int quoted = false);
         bool checkUnused();
+        bool hasHandler(const char* handlername);
         ~Protocol();
         void report();
     };
@@ -93,21 +97,36 @@ public:
 
 private:
     StreamBuffer filename;
-    FILE* file;
+    const char* input;            // file contents while parsing
+    const char* inputEnd;
+    int ungotten;                 // character put back or EOF
     int line;
     int quote;
     Protocol globalSettings;
     Protocol* protocols;
+    Protocol** lastProtocol;
+    NameIndex* protocolIndex;
     StreamProtocolParser* next;
     static StreamProtocolParser* parsers;
     bool valid;
+    struct FileHash;
+    static FileHash* fileHashes;
+    struct PathEntry;
+    static PathEntry* pathEntries;
 
-    StreamProtocolParser(FILE* file, const char* filename);
+    StreamProtocolParser(const char* contents, size_t size,
+        const char* filename);
     Protocol* getProtocol(const StreamBuffer& protocolAndParams);
     bool isGlobalContext(const StreamBuffer* commands);
     bool isHandlerContext(Protocol&, const StreamBuffer* commands);
+    static FILE* openFile(const char* file);
     static StreamProtocolParser* readFile(const char* file);
     bool parseProtocol(Protocol&, StreamBuffer* commands);
+    int getChar()
+        { if (ungotten != EOF) { int c = ungotten; ungotten = EOF; return c; }
+          return input < inputEnd ? (unsigned char)*input++ : EOF; }
+    void ungetChar(int c)
+        { ungotten = c; }
     int readChar();
     bool readToken(StreamBuffer& buffer,
         const char* specialchars = NULL, bool eofAllowed = false);
@@ -121,6 +140,10 @@ public:
     static Protocol* getProtocol(const char* file,
         const StreamBuffer& protocolAndParams);
     static void free();
+    static StreamProtocolParser* parseFile(const char* file);
+    static void indexPath();
+    static void addParser(StreamProtocolParser*);
+    static bool getFileHash(const char* file, StreamBuffer& hash);
     static const char* path;
     static const char* printString(StreamBuffer&, const char* string);
     void report();
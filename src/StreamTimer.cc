@@ -0,0 +1,545 @@
+/***************************************************************
+* StreamDevice Support                                         *
+*                                                              *
+* (C) 2005 Dirk Zimoch (dirk.zimoch@psi.ch)                    *
+*                                                              *
+* This is the timer service of StreamDevice (EPICS 3.14+).     *
+* Please refer to the HTML files in ../doc/ for a detailed     *
+* documentation.                                               *
+*                                                              *
+* If you do any changes in this file, you are not allowed to   *
+* redistribute it any more. If there is a bug or a missing     *
+* feature, send me an email and/or your patch. If I accept     *
+* your changes, they will go to the next release.              *
+*                                                              *
+* DISCLAIMER: If this software breaks something or harms       *
+* someone, it's your problem.                                  *
+*                                                              *
+***************************************************************/
+
+#include <epicsVersion.h>
+#ifndef BASE_VERSION
+// EPICS 3.13 uses watchdogs, nothing to do here
+
+#include "StreamTimer.h"
+#include "StreamError.h"
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsThread.h>
+#include <stdio.h>
+#include <limits.h>
+#include <math.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+
+// How it works:
+// Timers are kept in doubly linked lists, one per slot of four
+// wheels of 64 slots each. The first wheel holds timers which expire
+// within the next 64 ticks, one slot per tick. Each further wheel
+// covers 64 times the range of the previous one. Whenever the first
+// wheel has turned around, the next slot of the second wheel is
+// cascaded down (and so on). Thus start() and cancel() only link and
+// unlink a timer, while the wheel thread wakes up only for ticks with
+// something to do and at wheel boundaries.
+// Timers further away than the top wheel reaches are cascaded again
+// until they are due.
+
+struct TimerLink
+{
+    TimerLink* prev;
+    TimerLink* next;
+
+    void init() { prev = next = this; }
+    bool empty() const { return next == this; }
+    void insert(TimerLink* link) {
+        link->next = this;
+        link->prev = prev;
+        prev->next = link;
+        prev = link;
+    }
+    void remove() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = NULL;
+    }
+};
+
+class TimingWheel;
+
+class WheelTimer : public epicsTimer, TimerLink
+{
+    friend class TimingWheel;
+    TimingWheel& wheel;
+    epicsTimerNotify* notify;
+    unsigned long expires;  // in ticks
+
+    ~WheelTimer();
+public:
+    WheelTimer(TimingWheel& wheel);
+    // epicsTimer methods
+    void destroy();
+    void start(epicsTimerNotify& notify, const epicsTime& expireTime);
+    void start(epicsTimerNotify& notify, double delaySeconds);
+    void cancel();
+    expireInfo getExpireInfo() const;
+    void show(unsigned int level) const;
+};
+
+class TimingWheel
+{
+    enum { Bits = 6, Slots = 1 << Bits, Mask = Slots - 1, Levels = 4 };
+    enum { Range = 1 << (Bits * Levels) };
+
+    epicsMutex lock;
+    epicsEvent expireDone;      // running timer has returned
+    TimerLink slots[Levels][Slots];
+    unsigned long current;      // next tick to process
+    unsigned long cascaded;     // turn start cascade() last ran for
+    unsigned long armed;        // tick the thread wakes up for
+    bool isArmed;
+    long pending;
+    WheelTimer* running;
+    int waiters;
+    epicsThreadId thread;
+    double tick;                // in seconds
+#ifdef __linux__
+    int fd;
+    struct timespec t0;
+    uint64_t tickns;
+    uint64_t elapsed();
+#else
+    epicsEvent wakeup;
+    epicsTime t0;
+#endif
+
+    unsigned long now();
+    unsigned long expiry(double delay);
+    void insert(WheelTimer* timer);
+    void cascade();
+    long nextSlot();
+    void arm(unsigned long when);
+    void disarm();
+    void wait();
+    void run();
+    static void runThread(void* wheel);
+    friend class WheelTimer;
+public:
+    TimingWheel(double tick);
+    bool start();
+};
+
+TimingWheel::
+TimingWheel(double tick) : tick(tick)
+{
+    int i, j;
+
+    for (i = 0; i < Levels; i++)
+        for (j = 0; j < Slots; j++)
+            slots[i][j].init();
+    current = 0;
+    cascaded = 0;
+    armed = 0;
+    isArmed = false;
+    pending = 0;
+    running = NULL;
+    waiters = 0;
+    thread = NULL;
+#ifdef __linux__
+    fd = -1;
+    // round, 1e-4 * 1e9 is just below 100000
+    tickns = (uint64_t)(tick * 1e9 + 0.5);
+    if (!tickns) tickns = 1;
+    this->tick = tickns * 1e-9;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+#else
+    t0 = epicsTime::getCurrent();
+#endif
+}
+
+bool TimingWheel::
+start()
+{
+#ifdef __linux__
+    fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (fd < 0)
+    {
+        error("streamTimerWheel: timerfd_create() failed: %s\n",
+            strerror(errno));
+        return false;
+    }
+#endif
+    // same as the default of epicsTimerQueueActive::allocate()
+    thread = epicsThreadCreate("streamTimer", epicsThreadPriorityMin + 10,
+        epicsThreadGetStackSize(epicsThreadStackMedium), runThread, this);
+    if (!thread)
+    {
+        error("streamTimerWheel: cannot start timer thread\n");
+        return false;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// Nanoseconds since the wheel was created
+uint64_t TimingWheel::
+elapsed()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)(t.tv_sec - t0.tv_sec) * 1000000000u +
+        t.tv_nsec - t0.tv_nsec;
+}
+#endif
+
+// Ticks since the wheel was created (wraps around like jiffies)
+unsigned long TimingWheel::
+now()
+{
+#ifdef __linux__
+    return (unsigned long)(elapsed() / tickns);
+#else
+    return (unsigned long)fmod((epicsTime::getCurrent() - t0) / tick,
+        ULONG_MAX + 1.0);
+#endif
+}
+
+// Tick at which delay has passed for sure.
+// now() is rounded down, so add the tick already running.
+unsigned long TimingWheel::
+expiry(double delay)
+{
+    return now() + (delay > 0 ? (unsigned long)ceil(delay / tick) : 0) + 1;
+}
+
+// Links timer into its slot (called with lock held)
+void TimingWheel::
+insert(WheelTimer* timer)
+{
+    unsigned long expires = timer->expires;
+    long delta = (long)(expires - current);
+    int level;
+
+    if (delta < 0)
+    {
+        // overdue: run with the next tick
+        expires = current;
+        delta = 0;
+    }
+    if (delta >= Range)
+    {
+        // too far away: park in the last slot and cascade again
+        expires = current + Range - 1;
+        delta = Range - 1;
+    }
+    for (level = 0; delta >= (1L << (Bits * (level+1))); level++);
+    slots[level][(expires >> (Bits * level)) & Mask].insert(timer);
+}
+
+// Moves the timers of the slots now due one wheel down
+// (called with lock held at the start of each turn, once per turn)
+void TimingWheel::
+cascade()
+{
+    TimerLink list;
+    TimerLink* slot;
+    WheelTimer* timer;
+    int level, index;
+
+    if (cascaded == current) return;
+    cascaded = current;
+    for (level = 1; level < Levels; level++)
+    {
+        index = (current >> (Bits * level)) & Mask;
+        slot = &slots[level][index];
+        if (!slot->empty())
+        {
+            // detach first: timers may go back to the same wheel
+            list.init();
+            slot->next->prev = &list;
+            slot->prev->next = &list;
+            list.next = slot->next;
+            list.prev = slot->prev;
+            slot->init();
+            while (!list.empty())
+            {
+                timer = static_cast<WheelTimer*>(list.next);
+                timer->remove();
+                insert(timer);
+            }
+        }
+        if (index) break;
+    }
+}
+
+// Ticks from current to the next non-empty slot of the first wheel
+// or to the end of this turn (called with lock held)
+long TimingWheel::
+nextSlot()
+{
+    int index;
+
+    for (index = current & Mask; index < Slots; index++)
+    {
+        if (!slots[0][index].empty()) break;
+    }
+    return index - (current & Mask);
+}
+
+void TimingWheel::
+arm(unsigned long when)
+{
+    armed = when;
+    isArmed = true;
+#ifdef __linux__
+    struct itimerspec spec;
+    uint64_t ticks = elapsed() / tickns;
+    uint64_t ns;
+
+    // when has wrapped around with now(), ticks has not
+    ticks += (long)(when - (unsigned long)ticks);
+    ns = t0.tv_nsec + ticks * tickns;
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec = t0.tv_sec + (time_t)(ns / 1000000000u);
+    spec.it_value.tv_nsec = (long)(ns % 1000000000u);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+        spec.it_value.tv_nsec = 1; // 0 would disarm
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#else
+    wakeup.signal();
+#endif
+}
+
+void TimingWheel::
+disarm()
+{
+    isArmed = false;
+#ifdef __linux__
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#endif
+}
+
+// Sleeps until the armed tick or until start() re-arms earlier
+// (called without lock)
+void TimingWheel::
+wait()
+{
+#ifdef __linux__
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EINTR && errno != EAGAIN)
+    {
+        error("streamTimerWheel: read(timerfd) failed: %s\n",
+            strerror(errno));
+        epicsThreadSleep(tick);
+    }
+#else
+    lock.lock();
+    bool sleepForever = !isArmed;
+    double delay = ((long)(armed - now()) + 1) * tick;
+    lock.unlock();
+    if (sleepForever) wakeup.wait();
+    else if (delay > 0) wakeup.wait(delay);
+#endif
+}
+
+void TimingWheel::
+runThread(void* wheel)
+{
+    static_cast<TimingWheel*>(wheel)->run();
+}
+
+void TimingWheel::
+run()
+{
+    unsigned long target;
+    long step;
+    TimerLink* slot;
+    WheelTimer* timer;
+
+    lock.lock();
+    while (1)
+    {
+        target = now();
+        while (pending && (long)(target - current) >= 0)
+        {
+            if ((current & Mask) == 0) cascade();
+            step = nextSlot();
+            if (step)
+            {
+                // nothing to do until then
+                if (step > (long)(target - current) + 1)
+                    step = (long)(target - current) + 1;
+                current += step;
+                continue;
+            }
+            slot = &slots[0][current & Mask];
+            while (!slot->empty())
+            {
+                timer = static_cast<WheelTimer*>(slot->next);
+                timer->remove();
+                pending--;
+                running = timer;
+                lock.unlock();
+                epicsTimerNotify::expireStatus status =
+                    timer->notify->expire(epicsTime::getCurrent());
+                lock.lock();
+                running = NULL;
+                if (waiters) expireDone.signal();
+                if (status.restart() && !timer->next)
+                {
+                    timer->expires = expiry(status.expirationDelay());
+                    insert(timer);
+                    pending++;
+                }
+            }
+            current++;
+        }
+        // stopped at the start of a turn: its timers may still be
+        // in the upper wheels, which nextSlot() does not see
+        if (pending && (current & Mask) == 0) cascade();
+        if (!pending)
+        {
+            current = target + 1;
+            disarm();
+        }
+        else arm(current + nextSlot());
+        lock.unlock();
+        wait();
+        lock.lock();
+    }
+}
+
+WheelTimer::
+WheelTimer(TimingWheel& wheel) : wheel(wheel)
+{
+    prev = next = NULL;
+    notify = NULL;
+    expires = 0;
+}
+
+WheelTimer::
+~WheelTimer()
+{
+}
+
+void WheelTimer::
+destroy()
+{
+    cancel();
+    delete this;
+}
+
+void WheelTimer::
+start(epicsTimerNotify& notify, const epicsTime& expireTime)
+{
+    start(notify, expireTime - epicsTime::getCurrent());
+}
+
+void WheelTimer::
+start(epicsTimerNotify& notify, double delaySeconds)
+{
+    wheel.lock.lock();
+    if (next)
+    {
+        remove();
+        wheel.pending--;
+    }
+    if (!wheel.pending && wheel.running == NULL)
+    {
+        // wheel has been idle: catch up with the clock
+        // (nothing left to cascade for the turn just reached)
+        wheel.current = wheel.now();
+        wheel.cascaded = wheel.current;
+    }
+    this->notify = &notify;
+    expires = wheel.expiry(delaySeconds);
+    wheel.insert(this);
+    wheel.pending++;
+    if (!wheel.isArmed || (long)(expires - wheel.armed) < 0)
+        wheel.arm(expires);
+    wheel.lock.unlock();
+}
+
+void WheelTimer::
+cancel()
+{
+    wheel.lock.lock();
+    if (next)
+    {
+        remove();
+        wheel.pending--;
+    }
+    // wait for expire() to return unless called from it
+    while (wheel.running == this && epicsThreadGetIdSelf() != wheel.thread)
+    {
+        wheel.waiters++;
+        wheel.lock.unlock();
+        wheel.expireDone.wait();
+        wheel.lock.lock();
+        wheel.waiters--;
+        // pass on the wakeup to other waiters
+        if (wheel.waiters) wheel.expireDone.signal();
+    }
+    wheel.lock.unlock();
+}
+
+epicsTimer::expireInfo WheelTimer::
+getExpireInfo() const
+{
+    bool active;
+    double delay = 0;
+
+    wheel.lock.lock();
+    active = next != NULL;
+    if (active) delay = (long)(expires - wheel.now()) * wheel.tick;
+    wheel.lock.unlock();
+    return expireInfo(active, epicsTime::getCurrent() + delay);
+}
+
+void WheelTimer::
+show(unsigned int) const
+{
+    printf("WheelTimer %p: %s, expires at tick %lu\n",
+        (void*)this, next ? "pending" : "idle", expires);
+}
+
+static TimingWheel* timingWheel;
+static epicsThreadOnceId timingWheelOnce = EPICS_THREAD_ONCE_INIT;
+
+static void createTimingWheel(void*)
+{
+    TimingWheel* wheel = new TimingWheel(streamTimerWheel * 1e-6);
+    if (!wheel->start())
+    {
+        error("streamTimerWheel: using standard timer queues\n");
+        return;
+    }
+    debug("streamTimerWheel: tick %d usec\n", streamTimerWheel);
+    timingWheel = wheel;
+}
+
+epicsTimer& streamCreateTimer(epicsTimerQueueActive& queue)
+{
+    if (streamTimerWheel > 0)
+    {
+        epicsThreadOnce(&timingWheelOnce, createTimingWheel, NULL);
+        if (timingWheel) return *new WheelTimer(*timingWheel);
+    }
+    return queue.createTimer();
+}
+
+#endif
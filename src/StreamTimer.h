@@ -0,0 +1,34 @@
+/***************************************************************
+* StreamDevice Support                                         *
+*                                                              *
+* (C) 2005 Dirk Zimoch (dirk.zimoch@psi.ch)                    *
+*                                                              *
+* This is the timer service of StreamDevice (EPICS 3.14+).     *
+* Please refer to the HTML files in ../doc/ for a detailed     *
+* documentation.                                               *
+*                                                              *
+* If you do any changes in this file, you are not allowed to   *
+* redistribute it any more. If there is a bug or a missing     *
+* feature, send me an email and/or your patch. If I accept     *
+* your changes, they will go to the next release.              *
+*                                                              *
+* DISCLAIMER: If this software breaks something or harms       *
+* someone, it's your problem.                                  *
+*                                                              *
+***************************************************************/
+
+#ifndef StreamTimer_h
+#define StreamTimer_h
+
+#include <epicsTimer.h>
+
+// Set streamTimerWheel to a tick length in microseconds to take
+// all timers from one hierarchical timing wheel with constant time
+// start() and cancel(). On Linux, the wheel is driven by a timerfd.
+extern int streamTimerWheel;
+
+// Creates a timer on the timing wheel if enabled, else on queue.
+// Release it with destroy() as usual.
+epicsTimer& streamCreateTimer(epicsTimerQueueActive& queue);
+
+#endif
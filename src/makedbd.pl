@@ -2,6 +2,12 @@ if (@ARGV[0] == "-3.13") {
     shift;
 } else {
     print "variable(streamDebug, int)\n";
+    print "variable(streamLazyCompile, int)\n";
+    print "variable(streamParallelInit, int)\n";
+    print "variable(streamParallelScan, int)\n";
+    print "variable(streamParallelFormat, int)\n";
+    print "variable(streamSkipIdleDrain, int)\n";
+    print "variable(streamTimerWheel, int)\n";
     print "registrar(streamRegistrar)\n";
 }
 print "driver(stream)\n";